@@ -0,0 +1,316 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <cstdlib>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "normal.hpp"
+#include "rawimage.hpp"
+#include "tune.hpp"
+
+
+using namespace cv;
+using namespace std;
+
+
+/*
+  Accuracy harness
+
+  Runs on a folder written by ./synth. Solves the normals with the true
+  light directions to measure the solver on its own, then (given a number
+  of iterations) runs ./normal on the folder and measures the normals of
+  the calibration it found. Reports angular error against wall time.
+*/
+
+//error histogram resolution, degrees per bin
+#define ERROR_BIN 0.01
+#define ERROR_BINS 18001
+
+bool LoadLights(string file, Mat& L);
+Mat& SolveKnownLights(vector<Mat>& I, Mat& Linv, int th, Mat& N);
+bool AngularError(Mat& N, Mat& G, vector<Mat>& I, int th, vector<double>& stats);
+void PrintError(string label, vector<double>& stats, double seconds);
+
+
+int main( int argc, char* argv[]) {
+
+  UseTuneProfile();
+
+  if (argc < 3) {
+
+    cout << "Not enough parameters" << endl;
+    cout << "How to use: \n" << "'/Path/To/Synthetic/Folder' 'threshold(int)' ['iterations(int)' [normal options]]";
+    return -1;
+
+  }
+
+  string folder = argv[1];
+  int threshold = stoi(argv[2]);
+
+  Mat L;
+  if (!LoadLights(folder + "/lights.txt", L)) {
+    cout << "The lights " << folder << "/lights.txt could not be loaded." << endl;
+    return -1;
+  }
+
+  const int lights = L.rows;
+
+  vector<Mat> I(lights);
+  parallel_for_(Range(0, lights), [&](const Range& range) {
+    for(int k = range.start; k < range.end; k++) {
+      I[k] = imread(folder + "/final_" + to_string(k+1) + ".jpg", IMREAD_GRAYSCALE);
+    }
+  });
+
+  MappedRawImage gt;
+  if (!gt.open(folder + "/normal_gt.raw") || gt.mat.type() != CV_32FC3) {
+    cout << "The ground truth " << folder << "/normal_gt.raw could not be mapped." << endl;
+    return -1;
+  }
+
+  for(int k = 0; k < lights; k++) {
+    if (!I[k].data || I[k].size() != gt.mat.size()) {
+      cout << "The image final_" << k+1 << ".jpg could not be loaded or does not match the ground truth." << endl;
+      return -1;
+    }
+  }
+
+  //known lights, least squares for more than 3
+  //the unrolled kernels cover 3 and 4 lights, any other count synth writes takes the generic loop
+  NormalKernel kernel = SelectNormalKernel(lights, CV_8U, NORMAL_FLOAT3, true);
+
+  Mat Linv;
+  invert(L, Linv, DECOMP_SVD);
+
+  Mat N;
+  vector<double> stats;
+
+  double t = (double)getTickCount();
+  if (kernel) {
+    RunNormalKernel(kernel, NORMAL_FLOAT3, &I[0], N, Linv.ptr<double>(0), threshold);
+  } else {
+    SolveKnownLights(I, Linv, threshold, N);
+  }
+  t = ((double)getTickCount() - t)/getTickFrequency();
+
+  if (AngularError(N, gt.mat, I, threshold, stats)) {
+    PrintError("known lights", stats, t);
+  }
+
+  if (argc < 4) {
+    return 0;
+  }
+
+  //calibration search, as the tool is run on real sets
+  if (lights != 3) {
+    cout << "The calibration search needs 3 lights, the folder has " << lights << endl;
+    return 0;
+  }
+
+  //the calibration found is read back from the folder, a store would hold it instead
+  for(int k = 3; k < argc; k++) {
+    if (string(argv[k]) == "--store") {
+      cout << "--store keeps calibration.txt out of the folder, accuracy can not be run with it" << endl;
+      return -1;
+    }
+  }
+
+  //run directly, no shell to mangle the folder name; headless so no window or waitKey lands in the wall time
+  string th = to_string(threshold);
+  vector<char*> args;
+  args.push_back((char*)"./normal");
+  args.push_back(argv[1]);
+  args.push_back((char*)th.c_str());
+  for(int k = 3; k < argc; k++) {
+    args.push_back(argv[k]);
+  }
+  args.push_back((char*)"--headless");
+  args.push_back(NULL);
+
+  cout.flush();
+  t = (double)getTickCount();
+  int status = -1;
+  pid_t pid = fork();
+  if (pid == 0) {
+    execv(args[0], &args[0]);
+    _exit(127);
+  }
+  if (pid < 0 || waitpid(pid, &status, 0) != pid) {
+    status = -1;
+  }
+  t = ((double)getTickCount() - t)/getTickFrequency();
+
+  Mat S(3, 3, CV_8SC1, Scalar(0));
+  double Sinv[3][3];
+  if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+      !LoadCalibration(S, folder + "/calibration.txt") || !InvertCalibration(S, Sinv)) {
+    cout << "./normal on " << folder << " failed" << endl;
+    return -1;
+  }
+
+  RunNormalKernel(kernel, NORMAL_FLOAT3, &I[0], N, Sinv[0], threshold);
+
+  if (AngularError(N, gt.mat, I, threshold, stats)) {
+    PrintError("search", stats, t);
+  }
+
+  return 0;
+}
+
+
+//lights.txt as written by synth, one x y z direction per line
+bool LoadLights(string file, Mat& L) {
+
+  ifstream in(file);
+  if (!in.is_open()) {
+    return false;
+  }
+
+  vector<double> v;
+  double x;
+  while(in >> x) {
+    v.push_back(x);
+  }
+
+  if (v.size() < 9 || v.size() % 3 != 0) {
+    return false;
+  }
+
+  L = Mat((int)v.size()/3, 3, CV_64FC1, &v[0]).clone();
+  return true;
+}
+
+//Least squares normals for any number of lights, same threshold and flat fill as the NORMAL_FLOAT3 kernels
+Mat& SolveKnownLights(vector<Mat>& I, Mat& Linv, int th, Mat& N) {
+
+  const int lights = (int)I.size();
+  N.create(I[0].rows, I[0].cols, CV_32FC3);
+
+  parallel_for_(Range(0, N.rows), [&](const Range& range) {
+
+    vector<const uchar*> p(lights);
+
+    for(int i = range.start; i < range.end; ++i) {
+
+      for(int k = 0; k < lights; k++) {
+        p[k] = I[k].ptr<uchar>(i);
+      }
+      float* n = N.ptr<float>(i);
+
+      for(int j = 0; j < N.cols; ++j) {
+
+        double X[3] = { 0, 0, 0 };
+        bool keep = true;
+        for(int k = 0; k < lights; k++) {
+          double v = p[k][j];
+          for(int r = 0; r < 3; r++) {
+            X[r] += Linv.at<double>(r, k)*v;
+          }
+          keep = keep && p[k][j] > th;
+        }
+
+        double mag = sqrt(X[0]*X[0] + X[1]*X[1] + X[2]*X[2]);
+        keep = keep && mag > 0;
+
+        n[j*3] = keep ? (float)(X[0]/mag) : 0;
+        n[j*3 +1] = keep ? (float)(X[1]/mag) : 0;
+        n[j*3 +2] = keep ? (float)(X[2]/mag) : 1;
+      }
+    }
+
+  });
+
+  return N;
+}
+
+//stats = mean, median, 95th percentile (degrees) and the share of pixels measured
+//Pixels dark in any light get the flat fill and are left out, like the threshold does on real sets
+bool AngularError(Mat& N, Mat& G, vector<Mat>& I, int th, vector<double>& stats) {
+
+  const int rows = N.rows;
+  const int stripes = max(1, min(rows, getNumThreads()*4));
+
+  vector<long> histogram((size_t)stripes*ERROR_BINS, 0);
+  vector<double> sum(stripes, 0);
+
+  parallel_for_(Range(0, stripes), [&](const Range& range) {
+
+    for(int t = range.start; t < range.end; t++) {
+
+      long* h = &histogram[(size_t)t*ERROR_BINS];
+
+      for(int i = t*rows/stripes; i < (t+1)*rows/stripes; ++i) {
+
+        const float* n = N.ptr<float>(i);
+        const float* g = G.ptr<float>(i);
+
+        for(int j = 0; j < N.cols; ++j) {
+
+          bool keep = true;
+          for(size_t k = 0; k < I.size(); k++) {
+            keep = keep && (int)I[k].ptr<uchar>(i)[j] > th;
+          }
+          if (!keep) {
+            continue;
+          }
+
+          double d = n[j*3]*g[j*3] + n[j*3 +1]*g[j*3 +1] + n[j*3 +2]*g[j*3 +2];
+          double e = acos(max(-1.0, min(1.0, d)))*180/CV_PI;
+
+          h[min((int)(e/ERROR_BIN + 0.5), ERROR_BINS - 1)]++;
+          sum[t] += e;
+        }
+      }
+    }
+
+  });
+
+  vector<long> total(ERROR_BINS, 0);
+  long count = 0;
+  double mean = 0;
+  for(int t = 0; t < stripes; t++) {
+    for(int b = 0; b < ERROR_BINS; b++) {
+      total[b] += histogram[(size_t)t*ERROR_BINS + b];
+    }
+    mean += sum[t];
+  }
+  for(int b = 0; b < ERROR_BINS; b++) {
+    count += total[b];
+  }
+
+  if (count == 0) {
+    cout << "No pixel passes the threshold" << endl;
+    return false;
+  }
+
+  double median = 0, p95 = 0;
+  long seen = 0;
+  for(int b = 0; b < ERROR_BINS; b++) {
+    long before = seen;
+    seen += total[b];
+    if (before < (count+1)/2 && seen >= (count+1)/2) median = b*ERROR_BIN;
+    if (before < (long)(0.95*count) && seen >= (long)(0.95*count)) p95 = b*ERROR_BIN;
+  }
+
+  stats.clear();
+  stats.push_back(mean/count);
+  stats.push_back(median);
+  stats.push_back(p95);
+  stats.push_back((double)count/((double)N.rows*N.cols));
+
+  return true;
+}
+
+void PrintError(string label, vector<double>& stats, double seconds) {
+
+  cout << label << ": mean " << stats[0] << " deg, median " << stats[1] << " deg, 95% " << stats[2]
+       << " deg over " << 100*stats[3] << "% of the pixels, " << seconds << " s" << endl;
+}
@@ -6,15 +6,26 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include "albedo.hpp"
+#include "pool.hpp"
+#include "rawimage.hpp"
+#include "store.hpp"
+#include "texture.hpp"
+#include "tiles.hpp"
+#include "tune.hpp"
+
 
 using namespace cv;
 using namespace std;
 
-Mat& AverageImages(Mat& A, Mat& B, Mat& C, Mat& I);
+int StreamAlbedo(string folder, int stripRows);
 
 
 int main( int argc, char* argv[]) {
 
+  UseBufferPool();
+  UseTuneProfile();
+
   if (argc < 1) {
       
     cout << "Not enough parameters" << endl;
@@ -22,6 +33,50 @@ int main( int argc, char* argv[]) {
 
   }
 
+  if (argc > 3 && string(argv[2]) == "--strip") {
+    if (stoi(argv[3]) <= 0) {
+      cout << "--strip takes a positive number of rows" << endl;
+      return -1;
+    }
+    return StreamAlbedo(argv[1], stoi(argv[3]));
+  }
+
+  int tile = 0;
+  int overlap = DZI_OVERLAP;
+  bool ktx2 = false;
+  string storeFile;
+  string storeRoot;
+  for(int k = 2; k < argc; k++) {
+    string arg = argv[k];
+    if(arg == "--tiles") {
+      tile = k+1 < argc && isdigit(argv[k+1][0]) ? stoi(argv[++k]) : DZI_TILE;
+      if (tile < 1) {
+        cout << "--tiles takes a size of at least 1 pixel" << endl;
+        return -1;
+      }
+    } else if(arg == "--overlap" && k+1 < argc) {
+      overlap = stoi(argv[++k]);
+      if (overlap < 0) {
+        cout << "--overlap can not be negative" << endl;
+        return -1;
+      }
+    } else if(arg == "--ktx2") {
+      ktx2 = true;
+    } else if(arg == "--store" && k+1 < argc) {
+      storeFile = argv[++k];
+    } else if(arg == "--store-root" && k+1 < argc) {
+      storeRoot = argv[++k];
+    } else {
+      cout << "Unknown option " << arg << endl;
+      return -1;
+    }
+  }
+
+  if (!storeFile.empty() && (tile > 0 || ktx2)) {
+    cout << "--store holds the albedo image only, it can not be combined with --tiles or --ktx2" << endl;
+    return -1;
+  }
+
   Mat A, B, C, I, O;
 
   A = imread(argv[1]+string("/_1.jpg"), IMREAD_COLOR);
@@ -48,46 +103,83 @@ int main( int argc, char* argv[]) {
 
   O = AverageImages(A, B, C, I);
 
+  if (!storeFile.empty()) {
+    OutputStore store;
+    if (!store.open(storeFile, storeRoot) || !StoreImage(&store, argv[1]+string("/albedo.jpg"), O) || !store.close()) {
+      cout << "Could not write albedo.jpg to " << storeFile << endl;
+      return -1;
+    }
+    return 0;
+  }
+
   imwrite(argv[1]+string("/albedo.jpg"), O);
+
+  if (tile > 0 && !WriteDeepZoom(O, argv[1]+string("/albedo"), tile, false, overlap)) {
+    cout << "Could not write the albedo tiles" << endl;
+    return -1;
+  }
+
+  if (ktx2 && !WriteCompressedTexture(O, argv[1]+string("/albedo.ktx2"), false)) {
+    cout << "Could not write albedo.ktx2" << endl;
+    return -1;
+  }
  
   return 0;
 }
 
-Mat& AverageImages(Mat& A, Mat& B, Mat& C, Mat& I) {
+//same average over memory mapped _1.raw, _2.raw, _3.raw, written to albedo.raw a strip at a time
+int StreamAlbedo(string folder, int stripRows) {
 
-  // accept only char type matrices
-  CV_Assert(I.depth() == CV_8U);
+  MappedRawImage planes[3];
 
-  int channels = I.channels();
+  for(int k = 0; k < 3; k++) {
+    string file = folder+"/_"+to_string(k+1)+".raw";
+    if (!planes[k].open(file) || planes[k].mat.depth() != CV_8U) {
+      cout << "The image " << file << " could not be mapped." << endl;
+      return -1;
+    }
+  }
 
-  int nRows = I.rows;
-  int nCols = I.cols * channels;
+  Mat& A = planes[0].mat;
+  Mat& B = planes[1].mat;
+  Mat& C = planes[2].mat;
 
-  if (I.isContinuous()) {
-    nCols *= nRows;
-    nRows = 1;
+  if (A.size() != B.size() || A.size() != C.size() || A.type() != B.type() || A.type() != C.type()) {
+    cout << "The images in " << folder << " do not match." << endl;
+    return -1;
+  }
+
+  FILE* f = CreateRawImage(folder+"/albedo.raw", A.rows, A.cols, A.type());
+  if (!f) {
+    cout << "Could not write " << folder << "/albedo.raw" << endl;
+    return -1;
   }
 
-  int i,j;
-  uchar* pA;
-  uchar* pB;
-  uchar* pC;
-  uchar* pI;
-  for( i = 0; i < nRows; ++i) {
+  bool ok = true;
+  Mat I;
 
-    pA = A.ptr<uchar>(i);
-    pB = B.ptr<uchar>(i);
-    pC = C.ptr<uchar>(i);
-    pI = I.ptr<uchar>(i);
-    for ( j = 0; j < nCols; ++j) {
+  for(int r0 = 0; r0 < A.rows && ok; r0 += stripRows) {
 
-      pI[j] = ( pA[j] + pB[j] + pC[j] ) / 3;
+    int r1 = std::min(r0 + stripRows, A.rows);
 
+    Mat sa = A.rowRange(r0, r1);
+    Mat sb = B.rowRange(r0, r1);
+    Mat sc = C.rowRange(r0, r1);
+
+    I.create(r1 - r0, A.cols, A.type());
+    I = AverageImages(sa, sb, sc, I);
+    ok = AppendRawRows(f, I);
+
+    for(int k = 0; k < 3; k++) {
+      planes[k].evict(r0, r1);
     }
+
   }
 
-  return I;
+  if (fclose(f) != 0 || !ok) {
+    cout << "Could not write " << folder << "/albedo.raw" << endl;
+    return -1;
+  }
 
+  return 0;
 }
-
-
@@ -0,0 +1,47 @@
+#ifndef ALBEDO_HPP
+#define ALBEDO_HPP
+
+#include <opencv2/core/core.hpp>
+
+#include "tune.hpp"
+
+
+//I has to be allocated like A, it gets the per channel average of A, B and C
+//rows of A, B and C may be padded (views into larger buffers)
+inline cv::Mat& AverageImages(cv::Mat& A, cv::Mat& B, cv::Mat& C, cv::Mat& I) {
+
+  // accept only char type matrices
+  CV_Assert(I.depth() == CV_8U);
+
+  int channels = I.channels();
+
+  int nRows = I.rows;
+  int nCols = I.cols * channels;
+
+  cv::parallel_for_(cv::Range(0, nRows), [&](const cv::Range& range) {
+
+    int i,j;
+    unsigned char* pA;
+    unsigned char* pB;
+    unsigned char* pC;
+    unsigned char* pI;
+    for( i = range.start; i < range.end; ++i) {
+
+      pA = A.ptr<unsigned char>(i);
+      pB = B.ptr<unsigned char>(i);
+      pC = C.ptr<unsigned char>(i);
+      pI = I.ptr<unsigned char>(i);
+      for ( j = 0; j < nCols; ++j) {
+
+        pI[j] = ( pA[j] + pB[j] + pC[j] ) / 3;
+
+      }
+    }
+
+  }, TuneStripes(nRows, Tuning().averageStripes));
+
+  return I;
+
+}
+
+#endif
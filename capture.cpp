@@ -0,0 +1,374 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "albedo.hpp"
+#include "normal.hpp"
+#include "pool.hpp"
+#include "tune.hpp"
+
+
+using namespace cv;
+using namespace std;
+
+
+/*
+  Continuous capture
+
+  Watches a spool directory the rig drops frames into. Frames are named
+  [set]_[light].jpg (light 1, 2, 3, like _1.jpg .. _3.jpg in the folder
+  tools) and a set is only solved once all three of its frames are there,
+  so a missing or late frame can not shift the lights of later sets. Sets
+  still incomplete after --stale seconds, frames that do not follow the
+  naming and sets that fail to decode are moved to [spool]/rejected.
+  Each set is decoded into one of two preallocated slots, solved with the
+  last calibration and its normal/albedo maps written to the output folder
+  while the next set is already being decoded into the other slot.
+*/
+
+#define SLOTS 2
+
+struct Slot {
+  vector<uchar> file[3];
+  Mat color[3];
+  Mat gray[3];
+  Mat normal;
+  Mat albedo;
+  vector<uchar> encoded[2];
+  thread writer;
+};
+
+#define STALE_SET 60
+
+vector<string> ListReadyFrames(string dir, map<string, long>& sizes);
+bool ParseFrame(string name, string& set, int& light);
+bool ReadFile(string file, vector<uchar>& buf);
+bool WriteFile(string file, vector<uchar>& buf);
+long ModifiedTime(string file);
+
+
+int main( int argc, char* argv[]) {
+
+  //sets keep coming, every full size buffer is worth keeping
+  UseBufferPool(POOL_BATCH_MB);
+  UseTuneProfile();
+
+  if (argc < 5) {
+
+    cout << "Not enough parameters" << endl;
+    cout << "How to use: \n" << "'/Path/To/Spool' '/Path/To/Output' '/Path/To/calibration.txt' 'threshold(int)' [--idle seconds] [--stale seconds]";
+    return -1;
+
+  }
+
+  string spool = argv[1];
+  string output = argv[2];
+  string calibFile = argv[3];
+  int threshold = stoi(argv[4]);
+  double idle = 0;
+  double stale = STALE_SET;
+
+  for(int k = 5; k < argc; k++) {
+    string arg = argv[k];
+    if(arg == "--idle" && k+1 < argc) {
+      idle = stod(argv[++k]);
+    } else if(arg == "--stale" && k+1 < argc) {
+      stale = stod(argv[++k]);
+    } else {
+      cout << "Unknown option " << arg << endl;
+      return -1;
+    }
+  }
+
+  string processed = spool + "/processed";
+  string rejected = spool + "/rejected";
+  mkdir(processed.c_str(), 0755);
+  mkdir(rejected.c_str(), 0755);
+
+  Mat S(3, 3, CV_8SC1, Scalar(0));
+  double Sinv[3][3];
+  long calibTime = ModifiedTime(calibFile);
+
+  if (!LoadCalibration(S, calibFile)) {
+    cout << "The calibration " << calibFile << " could not be loaded." << endl;
+    return -1;
+  }
+  InvertCalibration(S, Sinv);
+
+  const NormalKernel kernel = SelectNormalKernel(3, CV_8U, NORMAL_BGR8, true);
+
+  Slot slots[SLOTS];
+  int next = 0;
+
+  map<string, long> sizes;
+  map<string, double> firstSeen;
+  long sets = 0;
+  double started = 0;
+  double lastFrame = (double)getTickCount();
+
+  while(1) {
+
+    //a new calibration.txt (e.g. from ./normal on one of the sets) is picked up between sets
+    long t = ModifiedTime(calibFile);
+    if (t != calibTime && LoadCalibration(S, calibFile)) {
+      InvertCalibration(S, Sinv);
+      calibTime = t;
+      cout << "Reloaded " << calibFile << endl;
+    }
+
+    vector<string> ready = ListReadyFrames(spool, sizes);
+    double now = (double)getTickCount()/getTickFrequency();
+
+    //frames of each set by light, "" where a light has not arrived yet
+    map<string, vector<string> > groups;
+    for(size_t k = 0; k < ready.size(); k++) {
+
+      string set;
+      int light;
+      vector<string>& group = groups[ParseFrame(ready[k], set, light) ? set : ""];
+      group.resize(3);
+
+      if (set.empty() || !group[light - 1].empty()) {
+        cout << "Rejecting " << ready[k] << ", frames have to be named [set]_1 .. [set]_3" << endl;
+        rename((spool + "/" + ready[k]).c_str(), (rejected + "/" + ready[k]).c_str());
+        sizes.erase(ready[k]);
+        continue;
+      }
+
+      group[light - 1] = ready[k];
+      if (firstSeen.find(set) == firstSeen.end()) {
+        firstSeen[set] = now;
+      }
+    }
+    groups.erase("");
+
+    //sets in name order, the first complete one is solved, incomplete ones age out
+    string name;
+    vector<string> frames;
+    for(map<string, vector<string> >::iterator it = groups.begin(); it != groups.end(); ++it) {
+
+      vector<string>& group = it->second;
+      bool complete = !group[0].empty() && !group[1].empty() && !group[2].empty();
+
+      if (complete && frames.empty()) {
+        name = it->first;
+        frames = group;
+      } else if (!complete && now - firstSeen[it->first] > stale) {
+        cout << "Rejecting set " << it->first << ", not all 3 frames arrived within " << stale << " seconds" << endl;
+        for(int k = 0; k < 3; k++) {
+          if (!group[k].empty()) {
+            rename((spool + "/" + group[k]).c_str(), (rejected + "/" + group[k]).c_str());
+            sizes.erase(group[k]);
+          }
+        }
+        firstSeen.erase(it->first);
+      }
+    }
+
+    if (frames.empty()) {
+      if (idle > 0 && ((double)getTickCount() - lastFrame)/getTickFrequency() > idle) {
+        break;
+      }
+      this_thread::sleep_for(chrono::milliseconds(10));
+      continue;
+    }
+
+    Slot& slot = slots[next];
+    next = (next + 1) % SLOTS;
+
+    //the slot is only reused once its previous set is on disk
+    if (slot.writer.joinable()) {
+      slot.writer.join();
+    }
+
+    double t0 = (double)getTickCount();
+    if (sets == 0) {
+      started = t0;
+    }
+
+    bool loaded[3] = { false, false, false };
+
+    parallel_for_(Range(0, 3), [&](const Range& range) {
+      for(int k = range.start; k < range.end; k++) {
+        if (!ReadFile(spool + "/" + frames[k], slot.file[k])) {
+          continue;
+        }
+        //decodes into the slot's buffer, no allocation once the size is settled
+        imdecode(slot.file[k], IMREAD_COLOR, &slot.color[k]);
+        if (!slot.color[k].data) {
+          continue;
+        }
+        cvtColor(slot.color[k], slot.gray[k], COLOR_BGR2GRAY);
+        loaded[k] = true;
+      }
+    });
+
+    bool ok = loaded[0] && loaded[1] && loaded[2] && slot.color[0].size() == slot.color[1].size() && slot.color[0].size() == slot.color[2].size();
+
+    for(int k = 0; k < 3; k++) {
+      string to = (ok ? processed : rejected) + "/" + frames[k];
+      rename((spool + "/" + frames[k]).c_str(), to.c_str());
+      sizes.erase(frames[k]);
+    }
+    firstSeen.erase(name);
+
+    if (!ok) {
+      cout << "Rejecting set " << name << ", frames could not be loaded" << endl;
+      continue;
+    }
+
+    RunNormalKernel(kernel, NORMAL_BGR8, slot.gray, slot.normal, Sinv[0], threshold);
+
+    slot.albedo.create(slot.color[0].rows, slot.color[0].cols, slot.color[0].type());
+    AverageImages(slot.color[0], slot.color[1], slot.color[2], slot.albedo);
+
+    Slot* s = &slot;
+    slot.writer = thread([s, output, name]() {
+      imencode(".jpg", s->normal, s->encoded[0]);
+      imencode(".jpg", s->albedo, s->encoded[1]);
+      if (!WriteFile(output + "/normal_" + name + ".jpg", s->encoded[0]) ||
+          !WriteFile(output + "/albedo_" + name + ".jpg", s->encoded[1])) {
+        cout << "Could not write the maps for " << name << endl;
+      }
+    });
+
+    sets++;
+    lastFrame = (double)getTickCount();
+
+    double latency = 1000*(lastFrame - t0)/getTickFrequency();
+    double elapsed = (lastFrame - started)/getTickFrequency();
+    cout << name << ": " << latency << " milliseconds";
+    if (sets > 1) {
+      cout << ", " << 3*(sets-1)/elapsed << " frames/sec";
+    }
+    cout << endl;
+
+  }
+
+  for(int k = 0; k < SLOTS; k++) {
+    if (slots[k].writer.joinable()) {
+      slots[k].writer.join();
+    }
+  }
+
+  cout << sets << " sets processed" << endl;
+  UseBufferPool()->printStats();
+
+  return 0;
+}
+
+
+//Image files in dir that kept the same size since the last call, sorted by name
+//dot files and .tmp/.part files are still being written by the camera
+vector<string> ListReadyFrames(string dir, map<string, long>& sizes) {
+
+  vector<string> ready;
+
+  DIR* d = opendir(dir.c_str());
+  if (!d) {
+    return ready;
+  }
+
+  struct dirent* entry;
+  while((entry = readdir(d)) != NULL) {
+
+    string name = entry->d_name;
+    if (name.empty() || name[0] == '.') continue;
+
+    size_t dot = name.find_last_of('.');
+    if (dot == string::npos) continue;
+
+    string ext = name.substr(dot);
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    if (ext != ".jpg" && ext != ".jpeg" && ext != ".png" && ext != ".tif" && ext != ".tiff") continue;
+
+    struct stat st;
+    if (stat((dir + "/" + name).c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+    map<string, long>::iterator it = sizes.find(name);
+    if (it != sizes.end() && it->second == (long)st.st_size && st.st_size > 0) {
+      ready.push_back(name);
+    }
+    sizes[name] = (long)st.st_size;
+
+  }
+
+  closedir(d);
+
+  sort(ready.begin(), ready.end());
+  return ready;
+}
+
+//[set]_[light].ext with light 1..3, set is everything before the last underscore
+bool ParseFrame(string name, string& set, int& light) {
+
+  set.clear();
+
+  size_t dot = name.find_last_of('.');
+  size_t underscore = name.find_last_of('_', dot);
+  if (dot == string::npos || underscore == string::npos || underscore == 0 || dot != underscore + 2) {
+    return false;
+  }
+
+  char c = name[underscore + 1];
+  if (c < '1' || c > '3') {
+    return false;
+  }
+
+  set = name.substr(0, underscore);
+  light = c - '0';
+  return true;
+}
+
+//reads into buf, keeps its capacity between calls
+bool ReadFile(string file, vector<uchar>& buf) {
+
+  FILE* f = fopen(file.c_str(), "rb");
+  if (!f) {
+    return false;
+  }
+
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  buf.resize(size > 0 ? size : 0);
+  bool ok = size > 0 && fread(buf.data(), 1, size, f) == (size_t)size;
+
+  fclose(f);
+  return ok;
+}
+
+bool WriteFile(string file, vector<uchar>& buf) {
+
+  FILE* f = fopen(file.c_str(), "wb");
+  if (!f) {
+    return false;
+  }
+
+  bool ok = fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+  return (fclose(f) == 0) && ok;
+}
+
+long ModifiedTime(string file) {
+
+  struct stat st;
+  if (stat(file.c_str(), &st) != 0) {
+    return 0;
+  }
+
+  return (long)st.st_mtime;
+}
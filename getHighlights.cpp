@@ -6,15 +6,20 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include "highlight.hpp"
+#include "pool.hpp"
+#include "tune.hpp"
+
 
 using namespace cv;
 using namespace std;
 
-Mat& getHighlight(Mat& I, int th);
-
 
 int main( int argc, char* argv[]) {
 
+  UseBufferPool();
+  UseTuneProfile();
+
   if (argc < 2) {
       
     cout << "Not enough parameters" << endl;
@@ -46,60 +51,14 @@ int main( int argc, char* argv[]) {
     return -1;
   }
 
-  O = A.clone();
-  O = getHighlight(A, th);
+  O = GetHighlight(A, th, O);
   imwrite(argv[1]+string("/highlight1.jpg"), O);
 
-  O = B.clone();
-  B = getHighlight(B, th);
-  imwrite(argv[1]+string("/highlight2.jpg"), B);
+  O = GetHighlight(B, th, O);
+  imwrite(argv[1]+string("/highlight2.jpg"), O);
 
-  O = C.clone();
-  C = getHighlight(C, th);
-  imwrite(argv[1]+string("/highlight3.jpg"), C);
+  O = GetHighlight(C, th, O);
+  imwrite(argv[1]+string("/highlight3.jpg"), O);
  
   return 0;
 }
-
-Mat& getHighlight(Mat& I, int th) {
-
-  // accept only char type matrices
-  CV_Assert(I.depth() == CV_8U);
-
-  int channels = I.channels();
-
-  int nRows = I.rows;
-  int nCols = I.cols * channels;
-
-  if (I.isContinuous()) {
-    nCols *= nRows;
-    nRows = 1;
-  }
-
-  int i,j;
-  
-  uchar* p;
-  for( i = 0; i < nRows; ++i) {
-
-  
-    p = I.ptr<uchar>(i);
-    for ( j = 0; j < nCols; ++j) {
-
-      if(p[j*3] > th && p[j*3 +1] > th && p[j*3 +2] > th) {
-        p[j*3] = 255;
-        p[j*3 +1] = 255;
-        p[j*3 +2] = 255;
-      } else {
-        p[j*3] = 0;
-        p[j*3 +1] = 0;
-        p[j*3 +2] = 0;
-      }
-      
-    }
-  }
-
-  return I;
-
-}
-
-
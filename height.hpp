@@ -0,0 +1,187 @@
+#ifndef HEIGHT_HPP
+#define HEIGHT_HPP
+
+#include <cmath>
+#include <algorithm>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+
+/*
+  Height from normals (Frankot-Chellappa)
+
+  The normal field is turned into surface gradients and the closest
+  integrable surface is found in the Fourier domain, O(n log n) in the
+  number of pixels. Normals use the normal map convention: x to the right,
+  y up, z towards the camera. Heights are in pixel units.
+*/
+
+//smaller tiles are mostly overlap, the feather is at least 16 pixels wide
+#define HEIGHT_TILE_MIN 64
+
+
+//p = dz/dcolumn, q = dz/drow, pixels at or below th (min intensity M) are flat
+inline void NormalGradients(const cv::Mat& N, const cv::Mat& M, int th, cv::Mat& p, cv::Mat& q) {
+
+  p.create(N.rows, N.cols, CV_32FC1);
+  q.create(N.rows, N.cols, CV_32FC1);
+
+  cv::parallel_for_(cv::Range(0, N.rows), [&](const cv::Range& range) {
+
+    for(int i = range.start; i < range.end; ++i) {
+
+      const float* n = N.ptr<float>(i);
+      const unsigned char* m = M.ptr<unsigned char>(i);
+      float* pp = p.ptr<float>(i);
+      float* pq = q.ptr<float>(i);
+
+      for(int j = 0; j < N.cols; ++j) {
+
+        //grazing normals would blow the gradients up
+        float nz = std::max(n[j*3 +2], 0.05f);
+        bool keep = m[j] > th;
+
+        pp[j] = keep ? -n[j*3]/nz : 0;
+        pq[j] = keep ? n[j*3 +1]/nz : 0;
+      }
+    }
+
+  });
+}
+
+//Least squares surface for the gradients p, q, both forward transforms run in parallel
+inline cv::Mat& FrankotChellappa(const cv::Mat& p, const cv::Mat& q, cv::Mat& Z) {
+
+  const int rows = p.rows;
+  const int cols = p.cols;
+  const int R = cv::getOptimalDFTSize(rows);
+  const int C = cv::getOptimalDFTSize(cols);
+
+  cv::Mat padded[2], spectrum[2];
+  copyMakeBorder(p, padded[0], 0, R - rows, 0, C - cols, cv::BORDER_REFLECT);
+  copyMakeBorder(q, padded[1], 0, R - rows, 0, C - cols, cv::BORDER_REFLECT);
+
+  cv::parallel_for_(cv::Range(0, 2), [&](const cv::Range& range) {
+    for(int k = range.start; k < range.end; k++) {
+      cv::dft(padded[k], spectrum[k], cv::DFT_COMPLEX_OUTPUT);
+    }
+  });
+
+  cv::Mat F(R, C, CV_32FC2);
+
+  cv::parallel_for_(cv::Range(0, R), [&](const cv::Range& range) {
+
+    for(int i = range.start; i < range.end; ++i) {
+
+      const float* P = spectrum[0].ptr<float>(i);
+      const float* Q = spectrum[1].ptr<float>(i);
+      float* f = F.ptr<float>(i);
+
+      double wy = 2*CV_PI*(i < R/2 ? i : i - R)/R;
+
+      for(int j = 0; j < C; ++j) {
+
+        double wx = 2*CV_PI*(j < C/2 ? j : j - C)/C;
+        double d = wx*wx + wy*wy;
+
+        if(d == 0) {
+          //mean height is free, keep it at 0
+          f[j*2] = 0;
+          f[j*2 +1] = 0;
+          continue;
+        }
+
+        //Z = (-i wx P - i wy Q) / (wx^2 + wy^2)
+        f[j*2] = (float)((wx*P[j*2 +1] + wy*Q[j*2 +1])/d);
+        f[j*2 +1] = (float)(-(wx*P[j*2] + wy*Q[j*2])/d);
+      }
+    }
+
+  });
+
+  cv::Mat z;
+  cv::dft(F, z, cv::DFT_INVERSE | cv::DFT_SCALE | cv::DFT_REAL_OUTPUT);
+  z(cv::Rect(0, 0, cols, rows)).copyTo(Z);
+
+  return Z;
+}
+
+//Height map (CV_32FC1) for the float normal field N
+inline cv::Mat& IntegrateHeight(const cv::Mat& N, const cv::Mat& M, int th, cv::Mat& H) {
+
+  cv::Mat p, q;
+  NormalGradients(N, M, th, p, q);
+  return FrankotChellappa(p, q, H);
+}
+
+//Same surface from overlapping tiles of size tile (at least HEIGHT_TILE_MIN), each transform
+//stays tile x tile where one transform of the whole image would be too slow or too large to pad.
+//This bounds the transforms only: the result and its blend weights are still full size planes
+//(8 bytes a pixel next to the 12 of N), gradients are made a tile at a time. Each tile is
+//shifted by a constant to match what is already placed in the overlap and feathered in, so
+//shape that spans many tiles (a slow bend across the scan) is only approximated
+inline cv::Mat& IntegrateHeightTiled(const cv::Mat& N, const cv::Mat& M, int th, int tile, cv::Mat& H) {
+
+  tile = std::max(tile, HEIGHT_TILE_MIN);
+
+  cv::Mat p, q;
+
+  const int overlap = std::max(tile/8, 16);
+  const int step = std::max(tile - overlap, 1);
+
+  cv::Mat sum(N.rows, N.cols, CV_32FC1, cv::Scalar(0));
+  cv::Mat weight(N.rows, N.cols, CV_32FC1, cv::Scalar(0));
+  cv::Mat Z;
+
+  for(int y = 0; y < N.rows; y += step) {
+    for(int x = 0; x < N.cols; x += step) {
+
+      cv::Rect r(x, y, std::min(tile, N.cols - x), std::min(tile, N.rows - y));
+      NormalGradients(N(r), M(r), th, p, q);
+      FrankotChellappa(p, q, Z);
+
+      cv::Mat s = sum(r);
+      cv::Mat w = weight(r);
+
+      //tiles only agree up to a constant, line this one up with the placed neighbours
+      double offset = 0;
+      long count = 0;
+      for(int i = 0; i < r.height; ++i) {
+        const float* ps = s.ptr<float>(i);
+        const float* pw = w.ptr<float>(i);
+        const float* pz = Z.ptr<float>(i);
+        for(int j = 0; j < r.width; ++j) {
+          if(pw[j] > 0) {
+            offset += ps[j]/pw[j] - pz[j];
+            count++;
+          }
+        }
+      }
+      if(count > 0) {
+        offset /= count;
+      }
+
+      for(int i = 0; i < r.height; ++i) {
+        float* ps = s.ptr<float>(i);
+        float* pw = w.ptr<float>(i);
+        const float* pz = Z.ptr<float>(i);
+        float wy = (float)std::min(std::min(i + 1, r.height - i), overlap)/overlap;
+        for(int j = 0; j < r.width; ++j) {
+          float wx = (float)std::min(std::min(j + 1, r.width - j), overlap)/overlap;
+          float f = wx*wy;
+          ps[j] += f*(pz[j] + (float)offset);
+          pw[j] += f;
+        }
+      }
+
+      if(x + tile >= N.cols) break;
+    }
+    if(y + tile >= N.rows) break;
+  }
+
+  cv::divide(sum, weight, H);
+  return H;
+}
+
+#endif
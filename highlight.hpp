@@ -0,0 +1,40 @@
+#ifndef HIGHLIGHT_HPP
+#define HIGHLIGHT_HPP
+
+#include <opencv2/core/core.hpp>
+
+#include "tune.hpp"
+
+
+//O gets white where all 3 channels of the BGR image I are above th, black elsewhere
+//O can be I itself
+inline cv::Mat& GetHighlight(const cv::Mat& I, int th, cv::Mat& O) {
+
+  // accept only 3 channel char type matrices
+  CV_Assert(I.type() == CV_8UC3);
+
+  O.create(I.rows, I.cols, CV_8UC3);
+
+  cv::parallel_for_(cv::Range(0, I.rows), [&](const cv::Range& range) {
+
+    for(int i = range.start; i < range.end; ++i) {
+
+      const unsigned char* p = I.ptr<unsigned char>(i);
+      unsigned char* o = O.ptr<unsigned char>(i);
+
+      for(int j = 0; j < I.cols; ++j) {
+
+        unsigned char v = (p[j*3] > th && p[j*3 +1] > th && p[j*3 +2] > th) ? 255 : 0;
+        o[j*3] = v;
+        o[j*3 +1] = v;
+        o[j*3 +2] = v;
+
+      }
+    }
+
+  }, TuneStripes(I.rows, Tuning().highlightStripes));
+
+  return O;
+}
+
+#endif
@@ -1,12 +1,25 @@
 #include <iostream>
 #include <vector>
 #include <cmath>
+#include <fstream>
+#include <sstream>
+#include <climits>
 #include <time.h> 
+#include <thread>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/video/tracking.hpp>
 
+#include "height.hpp"
+#include "normal.hpp"
+#include "pool.hpp"
+#include "rawimage.hpp"
+#include "store.hpp"
+#include "texture.hpp"
+#include "tiles.hpp"
+#include "tune.hpp"
 
 using namespace cv;
 using namespace std;
@@ -18,79 +31,414 @@ using namespace std;
 
 Mat& ScanImage(Mat& I);
 Mat& ComputeNormal(Mat& A, Mat& B, Mat& C, Mat& O, int th, Mat& S);
+Mat& ComputeNormalPacked(Mat& L, int cols, Mat& O, int th, Mat& S);
 Mat& GenerateRandomCalibration(Mat& I);
 Mat& GenerateRandomNeighbor(Mat& I);
+void GenerateNeighborBatch(Mat& I, vector<Mat>& batch);
+Mat& SolveUncalibrated(Mat& A, Mat& B, Mat& C, int th, Mat& S);
 long int CalculateCost(Mat& I);
 
+Mat& ComputeNormalField(Mat& A, Mat& B, Mat& C, Mat& N, Mat& S);
+Mat& ComputeMinIntensity(Mat& A, Mat& B, Mat& C, Mat& M);
+Mat& RenderNormalField(Mat& N, Mat& O);
+Mat& ApplyThreshold(Mat& R, Mat& M, Mat& O, int th);
+Mat& EncodeNormalField(Mat& N, Mat& M, Mat& F, int th, int depth);
+bool WriteNormalMap(string format, string name, Mat& o, Mat& N, Mat& M, int th, int tile, int overlap, OutputStore* store);
+bool WriteHeightMap(string format, string name, Mat& H, int tile, int overlap, OutputStore* store);
+Mat& ReduceStrips(Mat& I, Mat& R, int stripRows);
+bool StreamNormal(Mat& a, Mat& b, Mat& c, Mat& S, int th, int stripRows, bool floatOut, string file, MappedRawImage planes[3], int bandStart, int bandEnd);
+bool ParseList(string list, vector<float>& values);
+void BuildRectifyMaps(vector<float>& corners, Rect crop, Mat& W, Mat& map1, Mat& map2);
+Mat& PyramidReduce(Mat& I, Mat& R);
+void EstimateAlignment(Mat I[3], Mat W[3]);
+Mat& BuildCostSample(Mat& A, Mat& B, Mat& C, int th, int size, Mat& P);
+long int CalculateSampledCost(Mat& P, Mat& S, long int bound, int& evaluated);
+
 
 
 int main( int argc, char* argv[]) {
 
+  UseBufferPool();
+  UseTuneProfile();
+
   if (argc < 4) {
       
     cout << "Not enough parameters" << endl;
-    cout << "How to use: \n" << "'/Path/To/Folder' 'threshold(int)' 'iterations(int)'"; 
+    cout << "How to use: \n" << "'/Path/To/Folder' 'threshold(int)' 'iterations(int)' [--interactive | --headless] [--calib file] [--format jpg,png16,exr,tiff,raw,dzi,ktx2 [--tile size] [--overlap pixels]] [--strip rows [--band first,last]] [--rectify x1,y1,..,x4,y4 --crop x,y,w,h] [--align] [--svd] [--sample pixels | --batch] [--packed | --planar] [--time-budget seconds] [--converge iterations [--epsilon e]] [--temperature t] [--height | --height-tile size] [--store file [--store-root folder]]"; 
     return -1;
 
   }
 
-  Mat A, B, C, tmp;
-
-  int iterations = stoi(argv[3]);
-
-  Mat a = imread(argv[1]+string("/final_1.jpg"), IMREAD_GRAYSCALE);
-  Mat b = imread(argv[1]+string("/final_2.jpg"), IMREAD_GRAYSCALE);
-  Mat c = imread(argv[1]+string("/final_3.jpg"), IMREAD_GRAYSCALE);
-  
-  
-  A = imread(argv[1]+string("/final_1.jpg"), IMREAD_GRAYSCALE);
-  //TODO: change pyrDown for a resize solution that doesnt blur
-  pyrDown(A, tmp, Size(A.cols/2, A.rows/2));
-  A = tmp.clone();
-  pyrDown(A, tmp, Size(A.cols/2, A.rows/2));
-  A = tmp.clone();
-  pyrDown(A, tmp, Size(A.cols/2, A.rows/2));
-  A = tmp.clone();
-
-  B = imread(argv[1]+string("/final_2.jpg"), IMREAD_GRAYSCALE);
-  pyrDown(B, tmp, Size(B.cols/2, B.rows/2));
-  B = tmp.clone();
-  pyrDown(B, tmp, Size(B.cols/2, B.rows/2));
-  B = tmp.clone();
-  pyrDown(B, tmp, Size(B.cols/2, B.rows/2));
-  B = tmp.clone();
-
-  C = imread(argv[1]+string("/final_3.jpg"), IMREAD_GRAYSCALE);
-  pyrDown(C, tmp, Size(C.cols/2, C.rows/2));
-  C = tmp.clone();
-  pyrDown(C, tmp, Size(C.cols/2, C.rows/2));
-  C = tmp.clone();
-  pyrDown(C, tmp, Size(C.cols/2, C.rows/2));
-  C = tmp.clone();
+  bool interactive = false;
+  bool headless = false;
+  bool align = false;
+  bool batch = false;
+  //the autotuner may have found the packed layout faster on this host
+  bool packed = Tuning().packed;
+  bool svd = false;
+  string calibFile;
+  string storeFile;
+  string storeRoot;
+  vector<string> formats;
+  int stripRows = 0;
+  int samplePixels = 0;
+  int heightTile = -1;
+  int tile = DZI_TILE;
+  int overlap = DZI_OVERLAP;
+  double timeBudget = 0;
+  int converge = 0;
+  double epsilon = 0;
+  double temperature = 0;
+  vector<float> corners, cropRect, band;
+
+  for(int k = 4; k < argc; k++) {
+    string arg = argv[k];
+    if(arg == "--interactive") {
+      interactive = true;
+    } else if(arg == "--headless") {
+      headless = true;
+    } else if(arg == "--align") {
+      align = true;
+    } else if(arg == "--batch") {
+      batch = true;
+    } else if(arg == "--packed") {
+      packed = true;
+    } else if(arg == "--planar") {
+      packed = false;
+    } else if(arg == "--svd") {
+      svd = true;
+    } else if(arg == "--height") {
+      heightTile = 0;
+    } else if(arg == "--height-tile" && k+1 < argc) {
+      heightTile = stoi(argv[++k]);
+      if (heightTile < HEIGHT_TILE_MIN) {
+        cout << "--height-tile takes a size of at least " << HEIGHT_TILE_MIN << " pixels" << endl;
+        return -1;
+      }
+    } else if(arg == "--time-budget" && k+1 < argc) {
+      timeBudget = stod(argv[++k]);
+    } else if(arg == "--converge" && k+1 < argc) {
+      converge = stoi(argv[++k]);
+    } else if(arg == "--epsilon" && k+1 < argc) {
+      epsilon = stod(argv[++k]);
+    } else if(arg == "--temperature" && k+1 < argc) {
+      temperature = stod(argv[++k]);
+    } else if(arg == "--sample" && k+1 < argc) {
+      samplePixels = stoi(argv[++k]);
+    } else if(arg == "--calib" && k+1 < argc) {
+      calibFile = argv[++k];
+    } else if(arg == "--store" && k+1 < argc) {
+      storeFile = argv[++k];
+    } else if(arg == "--store-root" && k+1 < argc) {
+      storeRoot = argv[++k];
+    } else if(arg == "--format" && k+1 < argc) {
+      stringstream list(argv[++k]);
+      string format;
+      while(getline(list, format, ',')) {
+        if(format != "jpg" && format != "png16" && format != "exr" && format != "tiff" && format != "raw" && format != "dzi" && format != "ktx2") {
+          cout << "Unknown format " << format << endl;
+          return -1;
+        }
+        formats.push_back(format);
+      }
+    } else if(arg == "--tile" && k+1 < argc) {
+      tile = stoi(argv[++k]);
+      if (tile < 1) {
+        cout << "--tile takes a size of at least 1 pixel" << endl;
+        return -1;
+      }
+    } else if(arg == "--overlap" && k+1 < argc) {
+      overlap = stoi(argv[++k]);
+      if (overlap < 0) {
+        cout << "--overlap can not be negative" << endl;
+        return -1;
+      }
+    } else if(arg == "--strip" && k+1 < argc) {
+      //round up so every strip reduces to whole rows of the search image
+      stripRows = (stoi(argv[++k]) + 7) / 8 * 8;
+      if (stripRows <= 0) {
+        cout << "--strip takes a positive number of rows" << endl;
+        return -1;
+      }
+    } else if(arg == "--band" && k+1 < argc) {
+      if(!ParseList(argv[++k], band) || band.size() != 2 || band[0] < 0 || band[1] <= band[0]) {
+        cout << "--band takes the rows as first,last (last not included)" << endl;
+        return -1;
+      }
+    } else if(arg == "--rectify" && k+1 < argc) {
+      if(!ParseList(argv[++k], corners) || corners.size() != 8) {
+        cout << "--rectify takes the 4 corners as x1,y1,x2,y2,x3,y3,x4,y4" << endl;
+        return -1;
+      }
+    } else if(arg == "--crop" && k+1 < argc) {
+      if(!ParseList(argv[++k], cropRect) || cropRect.size() != 4) {
+        cout << "--crop takes the rectangle as x,y,width,height" << endl;
+        return -1;
+      }
+    } else {
+      cout << "Unknown option " << arg << endl;
+      return -1;
+    }
+  }
 
-  int threshold = stoi(argv[2]);
+  if (formats.empty()) {
+    formats.push_back("jpg");
+  }
 
+  if (batch && samplePixels > 0) {
+    cout << "--batch and --sample can not be combined" << endl;
+    return -1;
+  }
 
-  Mat O(A.rows,A.cols, CV_8UC3, Scalar(0,0,0));
-  Mat o(a.rows,a.cols, CV_8UC3, Scalar(0,0,0));
+  if (corners.empty() != cropRect.empty()) {
+    cout << "--rectify and --crop have to be used together" << endl;
+    return -1;
+  }
 
+  if (stripRows > 0 && (!corners.empty() || align)) {
+    cout << "Strip mode reads final_*.raw, it can not be combined with --rectify or --align" << endl;
+    return -1;
+  }
 
-  if (!A.data) {
-    cout << "The image" << argv[1] << " could not be loaded." << endl;
+  if (!band.empty() && (stripRows == 0 || calibFile.empty())) {
+    cout << "--band writes rows of a strip mode output with a fixed calibration, use it with --strip and --calib" << endl;
     return -1;
   }
 
-  if (!B.data) {
-    cout << "The image" << argv[1] << " could not be loaded." << endl;
+  if (interactive && headless) {
+    cout << "--interactive needs a display, it can not be combined with --headless" << endl;
     return -1;
   }
 
-  if (!C.data) {
+  if (stripRows > 0) {
+    for(size_t k = 0; k < formats.size(); k++) {
+      if(formats[k] != "jpg" && formats[k] != "raw") {
+        cout << "Strip mode only writes raw output, use --format jpg or raw" << endl;
+        return -1;
+      }
+    }
+    if (interactive || heightTile >= 0) {
+      cout << "Strip mode can not be interactive or integrate height" << endl;
+      return -1;
+    }
+  }
+
+  if (!storeFile.empty()) {
+    for(size_t k = 0; k < formats.size(); k++) {
+      if(formats[k] == "dzi" || formats[k] == "ktx2") {
+        cout << "--store holds single images, " << formats[k] << " output can not go into it" << endl;
+        return -1;
+      }
+    }
+    if (stripRows > 0) {
+      cout << "Strip mode streams to a raw file, it can not be combined with --store" << endl;
+      return -1;
+    }
+  }
+
+  //every product of the run is appended to one file instead of the folder, the store is
+  //only opened (and locked) once the maps are ready so parallel runs do not wait on the search
+  OutputStore outputStore;
+  OutputStore* store = storeFile.empty() ? NULL : &outputStore;
+  vector<pair<string, Mat> > saved;
+
+  //a loaded calibration skips the search, the search images are then never needed
+  bool search = calibFile.empty();
+
+  bool needField = interactive || heightTile >= 0;
+  bool needJpg = false;
+  for(size_t k = 0; k < formats.size(); k++) {
+    if(formats[k] == "jpg" || formats[k] == "dzi" || formats[k] == "ktx2") {
+      //the tile pyramid and the BC5 texture are made from the 8 bit render
+      needJpg = true;
+    } else {
+      needField = true;
+    }
+  }
+
+  Mat A, B, C;
+
+  int iterations = stoi(argv[3]);
+
+  Mat a, b, c;
+  MappedRawImage planes[3];
+  //the background decode reads these after the input block closes, so they live in main
+  string files[3];
+  Mat* full[3] = { &a, &b, &c };
+  thread fullDecode;
+
+  if (stripRows > 0) {
+
+    //gigapixel inputs stay on disk, only the 1/8 search images are held in memory
+    for(int k = 0; k < 3; k++) {
+      string file = argv[1]+string("/final_")+to_string(k+1)+".raw";
+      if (!planes[k].open(file) || planes[k].mat.type() != CV_8UC1) {
+        cout << "The image " << file << " could not be mapped." << endl;
+        return -1;
+      }
+    }
+
+    a = planes[0].mat;
+    b = planes[1].mat;
+    c = planes[2].mat;
+
+    if (a.size() != b.size() || a.size() != c.size()) {
+      cout << "The images in " << argv[1] << " are not the same size." << endl;
+      return -1;
+    }
+
+    if (!band.empty() && min((int)band[1], a.rows) <= (int)band[0]) {
+      cout << "The band is outside of the " << a.rows << " rows of the images" << endl;
+      return -1;
+    }
+
+    //the 1/8 pass reads all three images once more, only worth it when there is a search
+    if (search) {
+
+      A = ReduceStrips(a, A, stripRows);
+      B = ReduceStrips(b, B, stripRows);
+      C = ReduceStrips(c, C, stripRows);
+
+      for(int k = 0; k < 3; k++) {
+        planes[k].evict(0, a.rows);
+      }
+    }
+
+  } else if (!corners.empty()) {
+
+    //replaces transform.py and crop.py, the originals are warped straight
+    //into the crop window and never written back to disk
+    Mat src[3], dst[3];
+
+    parallel_for_(Range(0, 3), [&](const Range& range) {
+      for(int k = range.start; k < range.end; k++) {
+        src[k] = imread(argv[1]+string("/_")+to_string(k+1)+".jpg", IMREAD_GRAYSCALE);
+      }
+    });
+
+    for(int k = 0; k < 3; k++) {
+      if (!src[k].data) {
+        cout << "The image" << argv[1] << " could not be loaded." << endl;
+        return -1;
+      }
+    }
+
+    Rect crop((int)cropRect[0], (int)cropRect[1], (int)cropRect[2], (int)cropRect[3]);
+    Mat W[3], map1[3], map2[3];
+
+    if (align) {
+
+      //drift is folded into each image's lookup table so every image is still warped once
+      EstimateAlignment(src, W);
+      for(int k = 0; k < 3; k++) {
+        BuildRectifyMaps(corners, crop, W[k], map1[k], map2[k]);
+      }
+
+    } else {
+
+      BuildRectifyMaps(corners, crop, W[0], map1[0], map2[0]);
+      for(int k = 1; k < 3; k++) {
+        map1[k] = map1[0];
+        map2[k] = map2[0];
+      }
+
+    }
+
+    parallel_for_(Range(0, 3), [&](const Range& range) {
+      for(int k = range.start; k < range.end; k++) {
+        remap(src[k], dst[k], map1[k], map2[k], INTER_LINEAR, BORDER_CONSTANT);
+        src[k].release();
+      }
+    });
+
+    a = dst[0];
+    b = dst[1];
+    c = dst[2];
+
+    A = PyramidReduce(a, A);
+    B = PyramidReduce(b, B);
+    C = PyramidReduce(c, C);
+
+  } else {
+
+    Mat* reduced[3] = { &A, &B, &C };
+    for(int k = 0; k < 3; k++) {
+      files[k] = argv[1]+string("/final_")+to_string(k+1)+".jpg";
+    }
+
+    if (align) {
+
+      //alignment needs the full images up front, the search images are reduced from the warped ones
+      parallel_for_(Range(0, 3), [&](const Range& range) {
+        for(int k = range.start; k < range.end; k++) {
+          *full[k] = imread(files[k], IMREAD_GRAYSCALE);
+        }
+      });
+
+      if (!a.data || !b.data || !c.data) {
+        cout << "The image" << argv[1] << " could not be loaded." << endl;
+        return -1;
+      }
+
+      if (a.size() != b.size() || a.size() != c.size()) {
+        cout << "The images in " << argv[1] << " are not the same size." << endl;
+        return -1;
+      }
+
+      Mat I[3] = { a, b, c };
+      Mat W[3];
+      EstimateAlignment(I, W);
+
+      Mat warped;
+      warpAffine(b, warped, W[1], b.size(), INTER_LINEAR + WARP_INVERSE_MAP);
+      b = warped.clone();
+      warpAffine(c, warped, W[2], c.size(), INTER_LINEAR + WARP_INVERSE_MAP);
+      c = warped.clone();
+
+      A = PyramidReduce(a, A);
+      B = PyramidReduce(b, B);
+      C = PyramidReduce(c, C);
+
+    } else {
+
+      //the search images come straight out of the decoder at 1/8 scale (DCT scaling),
+      //the full images are only needed for the final render and decode while the search runs
+      parallel_for_(Range(0, 3), [&](const Range& range) {
+        for(int k = range.start; k < range.end; k++) {
+          *reduced[k] = imread(files[k], IMREAD_REDUCED_GRAYSCALE_8);
+        }
+      });
+
+      //plain threads, a parallel_for_ here would compete with the search's and one of them would run serially
+      fullDecode = thread([&]() {
+        thread decode[3];
+        for(int k = 0; k < 3; k++) {
+          decode[k] = thread([&, k]() { *full[k] = imread(files[k], IMREAD_GRAYSCALE); });
+        }
+        for(int k = 0; k < 3; k++) {
+          decode[k].join();
+        }
+      });
+
+    }
+
+  }
+
+  int threshold = stoi(argv[2]);
+
+
+  Mat O(A.rows,A.cols, CV_8UC3, Scalar(0,0,0));
+  Mat o;
+
+
+  if (search && (!A.data || !B.data || !C.data)) {
+    if (fullDecode.joinable()) {
+      fullDecode.join();
+    }
     cout << "The image" << argv[1] << " could not be loaded." << endl;
     return -1;
   }
 
-
   Mat CalibOld(3, 3, CV_8SC1, Scalar(0));
   Mat CalibNew(3, 3, CV_8SC1, Scalar(0));
 
@@ -99,36 +447,362 @@ int main( int argc, char* argv[]) {
 
   Mat C_clone = CalibOld.clone();
 
-  CalibOld = GenerateRandomCalibration(C_clone);
+  //fixed stratified subset of the search image, scored instead of a full render
+  Mat P;
+  long int evaluatedTotal = 0;
+  int evaluated = 0;
+  if (search && samplePixels > 0) {
+    P = BuildCostSample(A, B, C, threshold, samplePixels, P);
+  }
+
+  //the three search images interleaved once, every iteration then reads one stream
+  Mat L;
+  if (search && packed) {
+    Mat I[3] = { A, B, C };
+    L = PackLights(I, 3, L);
+  }
+
+  if (!calibFile.empty()) {
+
+    //reuse a previous search, skips annealing entirely
+    if (!LoadCalibration(CalibOld, calibFile)) {
+      if (fullDecode.joinable()) {
+        fullDecode.join();
+      }
+      cout << "The calibration " << calibFile << " could not be loaded." << endl;
+      return -1;
+    }
+
+    double Sinv[3][3];
+    if (!InvertCalibration(CalibOld, Sinv)) {
+      if (fullDecode.joinable()) {
+        fullDecode.join();
+      }
+      cout << "The calibration " << calibFile << " has no inverse." << endl;
+      return -1;
+    }
+
+  } else {
+
+    if (svd) {
+      //closed form start, the iterations (if any) only polish it
+      double t = (double)getTickCount();
+      CalibOld = SolveUncalibrated(A, B, C, threshold, C_clone);
+      t = 1000*((double)getTickCount() - t)/getTickFrequency();
+      cout << "SVD solve: " << t << " milliseconds" << endl;
+    } else {
+      CalibOld = GenerateRandomCalibration(C_clone);
+    }
+
+    //a start without an inverse would make the temperature (scaled by its cost) meaningless
+    double Sinv[3][3];
+    while (!InvertCalibration(CalibOld, Sinv)) {
+      cout << "The starting light matrix has no inverse, drawing a random one" << endl;
+      CalibOld = GenerateRandomCalibration(C_clone);
+    }
+
+    if (samplePixels > 0) {
+      costOld = CalculateSampledCost(P, CalibOld, LONG_MAX, evaluated);
+    } else {
+      O = packed ? ComputeNormalPacked(L, A.cols, O, threshold, CalibOld) : ComputeNormal(A, B, C, O, threshold, CalibOld);
+      costOld = CalculateCost(O);
+    }
+
+  }
+
+  //iterations is a cap, 0 with a time budget runs until the budget or convergence stops it
+  //a loaded calibration never searches, the outputs still carry the iterations asked for in their names
+  int maxIterations = calibFile.empty() ? iterations : 0;
+  if (calibFile.empty() && iterations <= 0 && timeBudget > 0) {
+    maxIterations = INT_MAX;
+  }
+
+  if (maxIterations > 0) {
+    cout << "Search layout: " << (packed ? "packed" : "planar") << (Tuning().loaded ? " (tuning profile loaded)" : "") << endl;
+  }
+
+  Mat CalibBest = CalibOld.clone();
+  long int costBest = costOld;
+  long int costWindow = costOld;
+  int bestIteration = 0;
+  double bestTime = 0;
+  int done = 0;
+  string stopped = "iterations";
+
+  //geometric cooling from temperature*(initial cost) down to a 1000th of it over the
+  //iterations or the time budget, whichever runs out first. 0 only takes improvements
+  double T0 = temperature*costOld;
+  double searchStart = (double)getTickCount();
+
+  for(int i = 0; i < maxIterations; i++) {
+
+    double elapsed = ((double)getTickCount() - searchStart)/getTickFrequency();
+
+    if (timeBudget > 0 && elapsed >= timeBudget) {
+      stopped = "time budget";
+      break;
+    }
+
+    //every converge iterations the best cost has to improve by more than epsilon (relative)
+    if (converge > 0 && i > 0 && i % converge == 0) {
+      if (costWindow - costBest <= epsilon*costWindow) {
+        stopped = "converged";
+        break;
+      }
+      costWindow = costBest;
+    }
 
+    double progress = 0;
+    if (maxIterations < INT_MAX) {
+      progress = (double)i/maxIterations;
+    }
+    if (timeBudget > 0) {
+      progress = max(progress, elapsed/timeBudget);
+    }
 
-  O = ComputeNormal(A, B, C, O, threshold, CalibOld);
-  costOld = CalculateCost(O);
+    //a candidate is taken when its cost is under limit, worse ones only with the Metropolis probability
+    long int limit = costOld;
+    if (T0 > 0) {
+      double T = T0*pow(1e-3, progress);
+      double u = (rand() + 1.0)/(RAND_MAX + 2.0);
+      limit = costOld + (long int)(-T*log(u));
+    }
+
+    done = i + 1;
 
-  for(int i = 0; i < iterations; i++) {
+    if (batch) {
 
-    C_clone = CalibOld.clone();
-    CalibNew = GenerateRandomNeighbor(C_clone);
+      //every entry of the matrix is perturbed once and all 9 are scored in one pass
+      vector<Mat> candidates;
+      GenerateNeighborBatch(CalibOld, candidates);
 
-    O = ComputeNormal(A, B, C, O, threshold, CalibNew);
-    costNew = CalculateCost(O);
+      double Sinv[BATCH_SIZE][3][3];
+      long costs[BATCH_SIZE];
+      bool singular[BATCH_SIZE];
+      for(int k = 0; k < BATCH_SIZE; k++) {
+        singular[k] = !InvertCalibration(candidates[k], Sinv[k]);
+      }
+
+      if (packed) {
+        CalculatePackedBatchCost(L, A.cols, Sinv[0][0], BATCH_SIZE, threshold, costs);
+      } else {
+        Mat I[3] = { A, B, C };
+        CalculateBatchCost(I, Sinv[0][0], BATCH_SIZE, threshold, costs);
+      }
+
+      for(int k = 0; k < BATCH_SIZE; k++) {
+        if (singular[k]) costs[k] = SINGULAR_COST;
+      }
+
+      int best = 0;
+      for(int k = 1; k < BATCH_SIZE; k++) {
+        if(costs[k] < costs[best]) best = k;
+      }
+
+      CalibNew = candidates[best];
+      costNew = costs[best];
+
+      if(costNew < limit) {
+        O = packed ? ComputeNormalPacked(L, A.cols, O, threshold, CalibNew) : ComputeNormal(A, B, C, O, threshold, CalibNew);
+      }
+
+    } else {
+
+      C_clone = CalibOld.clone();
+      CalibNew = GenerateRandomNeighbor(C_clone);
+
+      double Sinv[3][3];
+      if (!InvertCalibration(CalibNew, Sinv)) {
+        costNew = SINGULAR_COST;
+      } else if (samplePixels > 0) {
+        //stops as soon as the partial sum passes the acceptance limit, most candidates never finish
+        costNew = CalculateSampledCost(P, CalibNew, limit, evaluated);
+        evaluatedTotal += evaluated;
+        if(costNew < limit) {
+          O = packed ? ComputeNormalPacked(L, A.cols, O, threshold, CalibNew) : ComputeNormal(A, B, C, O, threshold, CalibNew);
+        }
+      } else {
+        O = packed ? ComputeNormalPacked(L, A.cols, O, threshold, CalibNew) : ComputeNormal(A, B, C, O, threshold, CalibNew);
+        costNew = CalculateCost(O);
+      }
+
+    }
     
-    if(costNew < costOld) {
-      cout << costNew << "\n";
-      namedWindow( "Display window", WINDOW_AUTOSIZE );// Create a window for display.
-      imshow( "Display window", O );    
-      waitKey(10);
+    if(costNew < limit) {
       costOld = costNew;
       CalibOld = CalibNew.clone();
     }
 
+    if(costOld < costBest) {
+      cout << costOld << "\n";
+      //batch nodes have no display to open a window on
+      if (!headless) {
+        namedWindow( "Display window", WINDOW_AUTOSIZE );// Create a window for display.
+        imshow( "Display window", O );    
+        waitKey(10);
+      }
+      costBest = costOld;
+      CalibBest = CalibOld.clone();
+      bestIteration = done;
+      bestTime = ((double)getTickCount() - searchStart)/getTickFrequency();
+    }
+
 
   } 
+
+  if (done > 0) {
+    //annealing may have wandered off, the output always uses the best one seen
+    CalibOld = CalibBest;
+    double total = ((double)getTickCount() - searchStart)/getTickFrequency();
+    cout << "Best cost " << costBest << " at iteration " << bestIteration << " (" << bestTime << " s), stopped on " << stopped << " after " << done << " iterations (" << total << " s)" << endl;
+  }
+
+  if (samplePixels > 0 && done > 0 && P.cols > 0) {
+    cout << "Sampled " << P.cols << " pixels, candidates read " << 100.0*evaluatedTotal/((double)done*P.cols) << "% of the sample on average" << endl;
+  }
+
+  if (!store && calibFile.empty()) {
+    SaveCalibration(CalibOld, argv[1]+string("/calibration.txt"));
+  }
+
+  if (stripRows > 0) {
+
+    bool floatOut = false;
+    for(size_t k = 0; k < formats.size(); k++) {
+      if(formats[k] == "raw") floatOut = true;
+    }
+
+    string file = argv[1]+string("/normal_")+to_string(threshold)+"_"+to_string(iterations)+".raw";
+    int bandStart = band.empty() ? 0 : (int)band[0];
+    int bandEnd = band.empty() ? a.rows : min((int)band[1], a.rows);
+    if (!StreamNormal(a, b, c, CalibOld, threshold, stripRows, floatOut, file, planes, bandStart, bandEnd)) {
+      cout << "Could not write " << file << endl;
+      return -1;
+    }
+
+    return 0;
+  }
   
+  if (fullDecode.joinable()) {
+
+    fullDecode.join();
+
+    if (!a.data || !b.data || !c.data) {
+      cout << "The image" << argv[1] << " could not be loaded." << endl;
+      return -1;
+    }
+
+    if (a.size() != b.size() || a.size() != c.size()) {
+      cout << "The images in " << argv[1] << " are not the same size." << endl;
+      return -1;
+    }
+
+  }
+
+  Mat N, M;
+  if (needField) {
+    N = ComputeNormalField(a, b, c, N, CalibOld);
+    M = ComputeMinIntensity(a, b, c, M);
+  }
+
+  if (interactive) {
 
-  o = ComputeNormal(a, b, c, o, threshold, CalibOld);
+    //threshold only picks which pixels get the flat fill, so solve the
+    //full-res field once and re-apply the threshold as a masked blend
+    Mat R;
+    R = RenderNormalField(N, R);
 
-  imwrite(argv[1]+string("/normal_")+to_string(threshold)+"_"+to_string(iterations)+(".jpg"), o);
+    namedWindow( "Threshold", WINDOW_NORMAL );
+    createTrackbar( "threshold", "Threshold", &threshold, 255 );
+
+    int shown = -1;
+    while(1) {
+
+      if(threshold != shown) {
+        double t = (double)getTickCount();
+        o = ApplyThreshold(R, M, o, threshold);
+        t = 1000*((double)getTickCount() - t)/getTickFrequency();
+        cout << "threshold " << threshold << ": " << t << " milliseconds" << endl;
+
+        imshow( "Threshold", o );
+        shown = threshold;
+      }
+
+      int k = waitKey(30) & 0xFF;
+      if(k == 's') {
+        string file = argv[1]+string("/normal_")+to_string(threshold)+"_"+to_string(iterations)+(".jpg");
+        if (store) {
+          //goes into the store with the other products when the window closes
+          saved.push_back(make_pair(file, o.clone()));
+        } else {
+          imwrite(file, o);
+        }
+      } else if(k == 27) {
+        break;
+      }
+
+    }
+
+  } else if (needJpg) {
+
+    o = ComputeNormal(a, b, c, o, threshold, CalibOld);
+
+  }
+
+  //integrated from the float field, never goes through the 8 bit map
+  Mat H;
+  if (heightTile >= 0) {
+    double t = (double)getTickCount();
+    if (heightTile > 0) {
+      H = IntegrateHeightTiled(N, M, threshold, heightTile, H);
+    } else {
+      H = IntegrateHeight(N, M, threshold, H);
+    }
+    t = 1000*((double)getTickCount() - t)/getTickFrequency();
+    cout << "Height: " << t << " milliseconds" << endl;
+  }
+
+  if (store) {
+
+    if (!outputStore.open(storeFile, storeRoot)) {
+      cout << "The store " << storeFile << " could not be opened." << endl;
+      return -1;
+    }
+
+    //the parameters travel with the maps, enough to rerun or compare runs
+    stringstream run;
+    run << "folder " << argv[1] << "\nthreshold " << threshold << "\niterations " << iterations << "\noptions";
+    for(int k = 4; k < argc; k++) {
+      run << " " << argv[k];
+    }
+    run << "\nlayout " << (packed ? "packed" : "planar") << "\ncost " << costBest << "\ndone " << done << "\nstopped " << stopped << "\n";
+
+    bool ok = StoreText(outputStore, argv[1]+string("/calibration.txt"), CalibrationText(CalibOld)) &&
+              StoreText(outputStore, argv[1]+string("/run.txt"), run.str());
+    for(size_t k = 0; k < saved.size() && ok; k++) {
+      ok = StoreImage(store, saved[k].first, saved[k].second);
+    }
+    if (!ok) {
+      cout << "Could not write to " << storeFile << endl;
+    }
+  }
+
+  //one format after the other: inside an outer parallel_for_ OpenCV runs nested ones serially,
+  //the tile pyramid, block compression and float encode loops each need the whole pool
+  string name = argv[1]+string("/normal_")+to_string(threshold)+"_"+to_string(iterations);
+  for(size_t k = 0; k < formats.size(); k++) {
+    if (!WriteNormalMap(formats[k], name, o, N, M, threshold, tile, overlap, store)) {
+      cout << "Could not write " << formats[k] << " output" << endl;
+    }
+    if (heightTile >= 0 && !WriteHeightMap(formats[k], argv[1]+string("/height_")+to_string(threshold)+"_"+to_string(iterations), H, tile, overlap, store)) {
+      cout << "Could not write " << formats[k] << " height" << endl;
+    }
+  }
+
+  if (store && !outputStore.close()) {
+    cout << "Could not close " << storeFile << endl;
+    return -1;
+  }
   
 
 
@@ -160,6 +834,133 @@ Mat& GenerateRandomCalibration(Mat& I) {
 
 }
 
+//Closed form light matrix from the rank 3 intensity matrix of the search images
+//The SVD of a subsample of the lit pixels whitens them, pseudo normals with identity
+//second moment. That leaves the normals known up to a rotation, fixed by asking for the
+//moments of a visible hemisphere seen from the front (mean along z, E[x^2] = E[y^2] = 1/4,
+//E[z^2] = 1/2). The remaining spin about z and mirror are picked with the usual cost,
+//on the quantized matrices so the pick is one the calibration file can hold
+Mat& SolveUncalibrated(Mat& A, Mat& B, Mat& C, int th, Mat& S) {
+
+  const int maxSamples = 20000;
+
+  long lit = 0;
+  for(int i = 0; i < A.rows; ++i) {
+    const uchar* pa = A.ptr<uchar>(i);
+    const uchar* pb = B.ptr<uchar>(i);
+    const uchar* pc = C.ptr<uchar>(i);
+    for(int j = 0; j < A.cols; ++j) {
+      if(pa[j] > th && pb[j] > th && pc[j] > th) lit++;
+    }
+  }
+
+  if(lit < 3) {
+    cout << "Not enough pixels above the threshold for the SVD solve, using a random start" << endl;
+    return GenerateRandomCalibration(S);
+  }
+
+  const long stride = max(1L, lit/maxSamples);
+  Mat D(3, (int)min(lit, (long)maxSamples), CV_64FC1);
+
+  int n = 0;
+  long seen = 0;
+  for(int i = 0; i < A.rows && n < D.cols; ++i) {
+    const uchar* pa = A.ptr<uchar>(i);
+    const uchar* pb = B.ptr<uchar>(i);
+    const uchar* pc = C.ptr<uchar>(i);
+    for(int j = 0; j < A.cols && n < D.cols; ++j) {
+      if(!(pa[j] > th && pb[j] > th && pc[j] > th)) continue;
+      if(seen++ % stride != 0) continue;
+      D.at<double>(0, n) = pa[j];
+      D.at<double>(1, n) = pb[j];
+      D.at<double>(2, n) = pc[j];
+      n++;
+    }
+  }
+  D = D.colRange(0, n);
+
+  Mat w, u, vt;
+  SVD::compute(D, w, u, vt);
+
+  //W takes intensities to whitened pseudo normals
+  Matx33d W;
+  for(int r = 0; r < 3; r++) {
+    double scale = w.at<double>(r) > 0 ? sqrt((double)n)/w.at<double>(r) : 0;
+    for(int k = 0; k < 3; k++) {
+      W(r, k) = scale*u.at<double>(k, r);
+    }
+  }
+
+  //rotate the mean pseudo normal onto z
+  Vec3d m(0, 0, 0);
+  for(int k = 0; k < n; k++) {
+    Vec3d d(D.at<double>(0, k), D.at<double>(1, k), D.at<double>(2, k));
+    m += W*d;
+  }
+  m = m/norm(m);
+
+  Vec3d axis = m.cross(Vec3d(0, 0, 1));
+  double sine = norm(axis), cosine = m[2];
+  Matx33d R0 = Matx33d::eye();
+  if(sine <= 1e-9 && cosine < 0) {
+    //facing straight away, half turn about x
+    R0 = Matx33d(1, 0, 0, 0, -1, 0, 0, 0, -1);
+  } else if(sine > 1e-9) {
+    axis = axis/sine;
+    Matx33d K(0, -axis[2], axis[1], axis[2], 0, -axis[0], -axis[1], axis[0], 0);
+    R0 = Matx33d::eye() + K*sine + K*K*(1 - cosine);
+  }
+
+  const Matx33d moments(0.5, 0, 0, 0, 0.5, 0, 0, 0, sqrt(0.5));
+
+  Mat O, candidate(3, 3, CV_8SC1, Scalar(0));
+  long int best = LONG_MAX;
+
+  for(int mirror = 0; mirror < 2; mirror++) {
+    for(int step = 0; step < 36; step++) {
+
+      double a = step*CV_PI/18;
+      Matx33d Rz(cos(a), -sin(a), 0, sin(a), cos(a), 0, 0, 0, 1);
+      Matx33d F(mirror ? -1 : 1, 0, 0, 0, 1, 0, 0, 0, 1);
+
+      //n = M i, so the light matrix (i = S n) is M inverse, scaled into the range the search uses
+      Matx33d L = (moments*F*Rz*R0*W).inv();
+
+      double top = 0;
+      for(int r = 0; r < 3; r++) {
+        for(int k = 0; k < 3; k++) {
+          top = max(top, L(r, k));
+        }
+      }
+      if(!(top > 0)) continue;
+
+      for(int r = 0; r < 3; r++) {
+        for(int k = 0; k < 3; k++) {
+          candidate.at<uchar>(r, k) = (uchar)max(0, min(255, (int)lround(200*L(r, k)/top)));
+        }
+      }
+
+      double Sinv[3][3];
+      if(!InvertCalibration(candidate, Sinv)) continue;
+
+      O = ComputeNormal(A, B, C, O, th, candidate);
+      long int cost = CalculateCost(O);
+      if(cost < best) {
+        best = cost;
+        candidate.copyTo(S);
+      }
+    }
+  }
+
+  //every rotation left the matrix without a positive entry or an inverse, S would stay all zeros
+  if(best == LONG_MAX) {
+    cout << "The SVD solve found no usable light matrix, using a random start" << endl;
+    return GenerateRandomCalibration(S);
+  }
+
+  return S;
+}
+
 Mat& GenerateRandomNeighbor(Mat& I) {
   
   int i,j;
@@ -179,6 +980,26 @@ Mat& GenerateRandomNeighbor(Mat& I) {
 
 }
 
+//one candidate per entry of I, each with that entry redrawn the same way GenerateRandomNeighbor does
+void GenerateNeighborBatch(Mat& I, vector<Mat>& batch) {
+
+  batch.resize(BATCH_SIZE);
+
+  for(int k = 0; k < BATCH_SIZE; k++) {
+
+    int i = k / 3;
+    int j = k % 3;
+
+    batch[k] = I.clone();
+    if(j == 0) {
+      batch[k].at<uchar>(i,j) = (rand() % 75) - 50;
+    } else {
+      batch[k].at<uchar>(i,j) = (rand() % 200);
+    }
+  }
+
+}
+
 long int CalculateCost(Mat& I) {
 
   // accept only char type matrices
@@ -224,122 +1045,530 @@ long int CalculateCost(Mat& I) {
 
 Mat& ComputeNormal(Mat& A, Mat& B, Mat& C, Mat& O, int th, Mat& S) {
 
-  //what is Threashold for again?
-  
-  /*
-    Assert that size of all Mat are the same
-    if not? throw warning but use bounds of smalles Mat
-  */
+  //Threshold -> pixels dark in any image get the flat (255,125,125) fill
+  static const NormalKernel kernel = SelectNormalKernel(3, CV_8U, NORMAL_BGR8, true);
+
+  CV_Assert(A.depth() == CV_8U && A.size() == B.size() && A.size() == C.size());
+
+  double Sinv[3][3];
+  InvertCalibration(S, Sinv);
+
+  Mat I[3] = { A, B, C };
+  return RunNormalKernel(kernel, NORMAL_BGR8, I, O, Sinv[0], th);
+}
+
+//Same render from the PackLights buffer of the 3 images
+Mat& ComputeNormalPacked(Mat& L, int cols, Mat& O, int th, Mat& S) {
 
+  static const NormalKernel kernel = SelectNormalKernel(3, CV_8U, NORMAL_BGR8, true, true);
 
   double Sinv[3][3];
+  InvertCalibration(S, Sinv);
+
+  return RunPackedNormalKernel(kernel, NORMAL_BGR8, L, cols, O, Sinv[0], th);
+}
+
+
+
+//unit normals as float (x,y,z), no threshold applied
+Mat& ComputeNormalField(Mat& A, Mat& B, Mat& C, Mat& N, Mat& S) {
+
+  //black in every image is treated as facing the camera
+  static const NormalKernel kernel = SelectNormalKernel(3, CV_8U, NORMAL_FLOAT3, false);
+
+  CV_Assert(A.depth() == CV_8U && A.size() == B.size() && A.size() == C.size());
+
+  double Sinv[3][3];
+  InvertCalibration(S, Sinv);
+
+  Mat I[3] = { A, B, C };
+  return RunNormalKernel(kernel, NORMAL_FLOAT3, I, N, Sinv[0], 0);
+}
+
+//darkest value across the images, a pixel passes the threshold when this is above it
+Mat& ComputeMinIntensity(Mat& A, Mat& B, Mat& C, Mat& M) {
+
+  cv::min(A, B, M);
+  cv::min(M, C, M);
+
+  return M;
+}
+
+//same encoding as ComputeNormal, stored BGR
+Mat& RenderNormalField(Mat& N, Mat& O) {
+
+  O.create(N.rows, N.cols, CV_8UC3);
+
+  parallel_for_(Range(0, N.rows), [&](const Range& range) {
+
+    for(int i = range.start; i < range.end; ++i) {
+
+      const float* n = N.ptr<float>(i);
+      uchar* o = O.ptr<uchar>(i);
+
+      for(int j = 0; j < N.cols; ++j) {
+        o[j*3] = (uchar)((n[j*3 +2]+1)*127.5f);
+        o[j*3 +1] = (uchar)((n[j*3 +1]+1)*127.5f);
+        o[j*3 +2] = (uchar)((n[j*3]+1)*127.5f);
+      }
+    }
+
+  });
+
+  return O;
+}
+
+//R is the unthresholded render, M the min intensity, pixels at or below th get the flat fill
+Mat& ApplyThreshold(Mat& R, Mat& M, Mat& O, int th) {
+
+  O.create(R.rows, R.cols, CV_8UC3);
+
+  parallel_for_(Range(0, R.rows), [&](const Range& range) {
+
+    for(int i = range.start; i < range.end; ++i) {
+
+      const uchar* r = R.ptr<uchar>(i);
+      const uchar* m = M.ptr<uchar>(i);
+      uchar* o = O.ptr<uchar>(i);
+
+      for(int j = 0; j < R.cols; ++j) {
+        bool keep = m[j] > th;
+        o[j*3] = keep ? r[j*3] : 255;
+        o[j*3 +1] = keep ? r[j*3 +1] : 125;
+        o[j*3 +2] = keep ? r[j*3 +2] : 125;
+      }
+    }
+
+  });
+
+  return O;
+}
+
+//threshold applied to the float field, BGR like the jpg
+//CV_32F keeps the unit vector in [-1,1], CV_16U maps it to [0,65535]
+Mat& EncodeNormalField(Mat& N, Mat& M, Mat& F, int th, int depth) {
+
+  CV_Assert(depth == CV_32F || depth == CV_16U);
+
+  F.create(N.rows, N.cols, CV_MAKETYPE(depth, 3));
+
+  parallel_for_(Range(0, N.rows), [&](const Range& range) {
+
+    for(int i = range.start; i < range.end; ++i) {
+
+      const float* n = N.ptr<float>(i);
+      const uchar* m = M.ptr<uchar>(i);
+
+      if(depth == CV_32F) {
+
+        float* f = F.ptr<float>(i);
+        for(int j = 0; j < N.cols; ++j) {
+          bool keep = m[j] > th;
+          f[j*3] = keep ? n[j*3 +2] : 1;
+          f[j*3 +1] = keep ? n[j*3 +1] : 0;
+          f[j*3 +2] = keep ? n[j*3] : 0;
+        }
+
+      } else {
+
+        ushort* f = F.ptr<ushort>(i);
+        for(int j = 0; j < N.cols; ++j) {
+          bool keep = m[j] > th;
+          f[j*3] = keep ? (ushort)((n[j*3 +2]+1)*32767.5f) : 65535;
+          f[j*3 +1] = keep ? (ushort)((n[j*3 +1]+1)*32767.5f) : 32767;
+          f[j*3 +2] = keep ? (ushort)((n[j*3]+1)*32767.5f) : 32767;
+        }
+
+      }
+    }
+
+  });
+
+  return F;
+}
+
+//encoder settings favour speed, the maps are decoded again downstream anyway
+bool WriteNormalMap(string format, string name, Mat& o, Mat& N, Mat& M, int th, int tile, int overlap, OutputStore* store) {
+
+  if(format == "jpg") {
+    return StoreImage(store, name + ".jpg", o);
+  }
+
+  if(format == "dzi") {
+    return WriteDeepZoom(o, name, tile, true, overlap);
+  }
+
+  if(format == "ktx2") {
+    return WriteCompressedTexture(o, name + ".ktx2", true);
+  }
+
+  Mat F;
+
+  if(format == "png16") {
+    F = EncodeNormalField(N, M, F, th, CV_16U);
+    return StoreImage(store, name + ".png", F, vector<int>{ IMWRITE_PNG_COMPRESSION, 1 });
+  }
+
+  F = EncodeNormalField(N, M, F, th, CV_32F);
+
+  if(format == "exr") {
+    return StoreImage(store, name + ".exr", F, vector<int>{ IMWRITE_EXR_TYPE, IMWRITE_EXR_TYPE_FLOAT });
+  }
+
+  if(format == "tiff") {
+    //1 = no compression
+    return StoreImage(store, name + ".tif", F, vector<int>{ IMWRITE_TIFF_COMPRESSION, 1 });
+  }
 
-  //Determinant and Inverse algorithm taken from www.thecrazyprogramer.com
-  float determinant = 0;
-  for(int i = 0; i < 3; i++) {
-    determinant = determinant + 
-    ( 
-      (int)S.at<uchar>(0,i)  * 
-        ( 
-          (int)S.at<uchar>(1,(i+1)%3)  * 
-          (int)S.at<uchar>(2,(i+2)%3)  - 
-          (int)S.at<uchar>(1,(i+2)%3)  * 
-          (int)S.at<uchar>(2,(i+1)%3) 
-        )
-    );      
+  return StoreRawImage(store, name + ".raw", F);
+}
+
+
+
+//8 and 16 bit formats are stretched to the full range, float formats keep pixel units
+bool WriteHeightMap(string format, string name, Mat& H, int tile, int overlap, OutputStore* store) {
+
+  if(format == "jpg" || format == "png16" || format == "dzi" || format == "ktx2") {
+
+    Mat F;
+    int depth = format == "png16" ? CV_16U : CV_8U;
+    normalize(H, F, 0, depth == CV_8U ? 255 : 65535, NORM_MINMAX, depth);
+
+    if(format == "jpg") {
+      return StoreImage(store, name + ".jpg", F);
+    }
+    if(format == "dzi") {
+      return WriteDeepZoom(F, name, tile, false, overlap);
+    }
+    if(format == "ktx2") {
+      return WriteCompressedTexture(F, name + ".ktx2", false);
+    }
+    return StoreImage(store, name + ".png", F, vector<int>{ IMWRITE_PNG_COMPRESSION, 1 });
+  }
+
+  if(format == "exr") {
+    return StoreImage(store, name + ".exr", H, vector<int>{ IMWRITE_EXR_TYPE, IMWRITE_EXR_TYPE_FLOAT });
+  }
+
+  if(format == "tiff") {
+    return StoreImage(store, name + ".tif", H, vector<int>{ IMWRITE_TIFF_COMPRESSION, 1 });
+  }
+
+  return StoreRawImage(store, name + ".raw", H);
+}
+
+//1/8 area reduction of I, computed strip by strip so I can stay memory mapped
+Mat& ReduceStrips(Mat& I, Mat& R, int stripRows) {
+
+  int nRows = I.rows/8*8;
+  int nCols = I.cols/8*8;
+
+  R.create(nRows/8, nCols/8, CV_8UC1);
+
+  for(int r0 = 0; r0 < nRows; r0 += stripRows) {
+
+    int r1 = std::min(r0 + stripRows, nRows);
+
+    Mat src = I(Range(r0, r1), Range(0, nCols));
+    Mat dst = R.rowRange(r0/8, r1/8);
+    resize(src, dst, dst.size(), 0, 0, INTER_AREA);
 
-    // DONT DELETE
-    // determinant = determinant + (source[0][i] * (source[1][(i+1)%3] * source[2][(i+2)%3] - source[1][(i+2)%3] * source[2][(i+1)%3]));      
   }
 
+  return R;
+}
+
+//renders the full-res map one strip at a time and appends each strip to a raw container
+//8 bit BGR like the jpg, or the float field when floatOut is set
+//rows [bandStart,bandEnd), a band smaller than the image is written into the shared output in place
+bool StreamNormal(Mat& a, Mat& b, Mat& c, Mat& S, int th, int stripRows, bool floatOut, string file, MappedRawImage planes[3], int bandStart, int bandEnd) {
+
+  int type = floatOut ? CV_32FC3 : CV_8UC3;
+  bool whole = bandStart == 0 && bandEnd == a.rows;
+
+  FILE* f = whole ? CreateRawImage(file, a.rows, a.cols, type) : OpenRawImageRows(file, a.rows, a.cols, type, bandStart);
+  if (!f) {
+    return false;
+  }
 
-  for(int i = 0; i < 3; i++) {
-    for(int j = 0; j < 3; j++) {
-      Sinv[i][j] = (((int)S.at<uchar>( (j+1)%3, (i+1)%3 ) * (int)S.at<uchar>( (j+2)%3, (i+2)%3 )) - ((int)S.at<uchar>( (j+1)%3, (i+2)%3 ) * (int)S.at<uchar>( (j+2)%3, (i+1)%3 )))/determinant;
+  bool ok = true;
+  Mat o, N, M, F;
+
+  for(int r0 = bandStart; r0 < bandEnd && ok; r0 += stripRows) {
+
+    int r1 = std::min(r0 + stripRows, bandEnd);
+
+    Mat sa = a.rowRange(r0, r1);
+    Mat sb = b.rowRange(r0, r1);
+    Mat sc = c.rowRange(r0, r1);
+
+    if (floatOut) {
+      N = ComputeNormalField(sa, sb, sc, N, S);
+      M = ComputeMinIntensity(sa, sb, sc, M);
+      F = EncodeNormalField(N, M, F, th, CV_32F);
+      ok = AppendRawRows(f, F);
+    } else {
+      o.create(r1 - r0, a.cols, CV_8UC3);
+      o = ComputeNormal(sa, sb, sc, o, th, S);
+      ok = AppendRawRows(f, o);
     }
+
+    for(int k = 0; k < 3; k++) {
+      planes[k].evict(r0, r1);
+    }
+
   }
-  
 
-  //current assumption use only grayscale image
-  int nRows = A.rows;
-  int nCols = A.cols;
-  if (A.isContinuous()) {
+  //a band is only reported done once its rows are on disk
+  if (!whole) {
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+  }
 
-    nCols *= nRows;
-    nRows = 1;
-    
+  return (fclose(f) == 0) && ok;
+}
+
+
+
+bool ParseList(string list, vector<float>& values) {
+
+  stringstream in(list);
+  string value;
+  values.clear();
+
+  while(getline(in, value, ',')) {
+    try {
+      values.push_back(stof(value));
+    } catch (...) {
+      return false;
+    }
   }
 
-  int i,j;
-  uchar* p1;
-  uchar* p2;
-  uchar* p3;
+  return true;
+}
 
-  uchar* o;
+//Inverse perspective lookup for every pixel of the crop window, computed once and shared by all images
+//corners are clicked in the same order as transform.py: bottom left, top left, top right, bottom right
+//W is an optional 2x3 alignment from EstimateAlignment applied on top of the homography
+void BuildRectifyMaps(vector<float>& corners, Rect crop, Mat& W, Mat& map1, Mat& map2) {
 
-  double maxR = 0, minR = 255, maxB = 0, minB = 255, maxG = 0, minG = 255;
+  Point2f src[4], dst[4];
+  for(int k = 0; k < 4; k++) {
+    src[k] = Point2f(corners[k*2], corners[k*2 +1]);
+  }
 
-  for( i = 0; i < nRows; ++i) {
+  dst[0] = src[0];
+  dst[1] = Point2f(src[0].x, src[2].y);
+  dst[2] = src[2];
+  dst[3] = Point2f(src[2].x, src[0].y);
 
-    //pn are full rows we index rows like p[j]
-    p1 = A.ptr<uchar>(i);
-    p2 = B.ptr<uchar>(i);
-    p3 = C.ptr<uchar>(i);
+  Mat H = getPerspectiveTransform(src, dst);
+  Mat Hinv = H.inv();
+  const double* h = Hinv.ptr<double>(0);
 
-    o = O.ptr<uchar>(i);
-    
-    for ( j = 0; j < nCols; ++j) {
-      int I[3];
+  double w[6] = { 1, 0, 0, 0, 1, 0 };
+  if (!W.empty()) {
+    for(int k = 0; k < 6; k++) {
+      w[k] = W.at<float>(k/3, k%3);
+    }
+  }
 
-      //get pixels across all 3 images
-      I[0] = (int)p1[j];
-      I[1] = (int)p2[j];
-      I[2] = (int)p3[j];
+  Mat mapx(crop.height, crop.width, CV_32FC1);
+  Mat mapy(crop.height, crop.width, CV_32FC1);
 
-      double N[3];
-      double n[3];
-      double mag = 0;
+  parallel_for_(Range(0, crop.height), [&](const Range& range) {
+
+    for(int i = range.start; i < range.end; ++i) {
 
-      if(I[0] > th && I[1] > th && I[2] > th) {
+      float* px = mapx.ptr<float>(i);
+      float* py = mapy.ptr<float>(i);
+      double y = i + crop.y;
 
-        //Compute N
-        N[0] = Sinv[0][0]*I[0] + Sinv[0][1]*I[1] + Sinv[0][2]*I[2]; 
-        N[1] = Sinv[1][0]*I[0] + Sinv[1][1]*I[1] + Sinv[1][2]*I[2]; 
-        N[2] = Sinv[2][0]*I[0] + Sinv[2][1]*I[1] + Sinv[2][2]*I[2];
+      for(int j = 0; j < crop.width; ++j) {
+        double x = j + crop.x;
+        double z = h[6]*x + h[7]*y + h[8];
+        double sx = (h[0]*x + h[1]*y + h[2])/z;
+        double sy = (h[3]*x + h[4]*y + h[5])/z;
+        px[j] = (float)(w[0]*sx + w[1]*sy + w[2]);
+        py[j] = (float)(w[3]*sx + w[4]*sy + w[5]);
+      }
+    }
 
-        mag = sqrt(pow(N[0],2)+pow(N[1],2)+pow(N[2],2));
-        n[0] = ((N[0]/mag)+1)*127.5;
-        n[1] = ((N[1]/mag)+1)*127.5;
-        n[2] = ((N[2]/mag)+1)*127.5;
+  });
 
+  //fixed point tables, faster to remap with than the float ones
+  convertMaps(mapx, mapy, map1, map2, CV_16SC2);
+}
 
-        o[j*3] = n[2];
-        o[j*3 +1 ] = n[1];
-        o[j*3 +2 ] = n[0];
-       
+//1/8 search image, same three pyrDowns as the jpg path
+Mat& PyramidReduce(Mat& I, Mat& R) {
 
+  Mat tmp;
+  pyrDown(I, R, Size(I.cols/2, I.rows/2));
+  pyrDown(R, tmp, Size(R.cols/2, R.rows/2));
+  pyrDown(tmp, R, Size(tmp.cols/2, tmp.rows/2));
 
-        if(n[0] > maxB) maxB = n[0];
-        if(n[0] < minB) minB = n[0];
+  return R;
+}
 
-        if(n[1] > maxG) maxG = n[1];
-        if(n[1] < minG) minG = n[1];
+//Euclidean warps taking points of I[0] into I[1] and I[2], W[0] is left empty (identity)
+//ECC runs coarse to fine from ~256px wide up to the last level under ~2048px wide,
+//so the cost does not grow with the sensor size, the images are warped later by the caller
+void EstimateAlignment(Mat I[3], Mat W[3]) {
 
-        if(n[2] > maxR) maxR = n[2];
-        if(n[2] < minR) minR = n[2];
+  double t = (double)getTickCount();
 
-      } else {
-        o[j*3] = 255;
-        o[j*3 +1 ] = 125;
-        o[j*3 +2 ] = 125;
+  int coarse = 0, fine = 0;
+  while((I[0].cols >> (coarse+1)) >= 256) coarse++;
+  while((I[0].cols >> fine) > 2048 && fine < coarse) fine++;
+
+  vector<Mat> pyramid[3];
+  parallel_for_(Range(0, 3), [&](const Range& range) {
+    for(int k = range.start; k < range.end; k++) {
+      buildPyramid(I[k], pyramid[k], coarse);
+    }
+  });
+
+  W[0] = Mat();
+
+  parallel_for_(Range(1, 3), [&](const Range& range) {
+    for(int k = range.start; k < range.end; k++) {
+
+      Mat warp = Mat::eye(2, 3, CV_32F);
+
+      for(int level = coarse; level >= fine; level--) {
+
+        if(level < coarse) {
+          warp.at<float>(0,2) *= 2;
+          warp.at<float>(1,2) *= 2;
+        }
+
+        try {
+          findTransformECC(pyramid[0][level], pyramid[k][level], warp, MOTION_EUCLIDEAN,
+            TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, 50, 1e-4));
+        } catch (cv::Exception&) {
+          //keep the estimate from the coarser level
+          cout << "Alignment of image " << k+1 << " did not converge at level " << level << endl;
+        }
       }
 
+      warp.at<float>(0,2) *= (float)(1 << fine);
+      warp.at<float>(1,2) *= (float)(1 << fine);
+      W[k] = warp;
+
     }
+  });
+
+  t = 1000*((double)getTickCount() - t)/getTickFrequency();
+  for(int k = 1; k < 3; k++) {
+    cout << "image " << k+1 << " offset " << W[k].at<float>(0,2) << " " << W[k].at<float>(1,2) << endl;
   }
+  cout << "Alignment: " << t << " milliseconds" << endl;
+}
 
-  return O;
+
+
+//Packs the intensities of up to size pixels that pass th into a single row (1 x n, CV_8UC3)
+//Pixels below th always cost 0 so they are left out. The passing pixels are split
+//into n equal strata in raster order and one random pixel is taken from each, strata
+//are then laid out in bit reversed order so every prefix of P covers the whole image
+Mat& BuildCostSample(Mat& A, Mat& B, Mat& C, int th, int size, Mat& P) {
+
+  CV_Assert(A.isContinuous() && B.isContinuous() && C.isContinuous());
+
+  vector<int> passing;
+  passing.reserve(A.rows*A.cols);
+
+  for(int i = 0; i < A.rows; ++i) {
+    const uchar* p1 = A.ptr<uchar>(i);
+    const uchar* p2 = B.ptr<uchar>(i);
+    const uchar* p3 = C.ptr<uchar>(i);
+    for(int j = 0; j < A.cols; ++j) {
+      if(p1[j] > th && p2[j] > th && p3[j] > th) {
+        passing.push_back(i*A.cols + j);
+      }
+    }
+  }
+
+  int n = std::min(size, (int)passing.size());
+  P.create(1, n, CV_8UC3);
+
+  int bits = 0;
+  while((1 << bits) < n) bits++;
+
+  uchar* p = P.ptr<uchar>(0);
+  int k = 0;
+
+  for(int r = 0; r < (1 << bits); ++r) {
+
+    int s = 0;
+    for(int b = 0; b < bits; ++b) {
+      if(r & (1 << b)) s |= 1 << (bits - 1 - b);
+    }
+    if(s >= n) continue;
+
+    long begin = (long)s * passing.size() / n;
+    long end = (long)(s+1) * passing.size() / n;
+    int index = passing[begin + rand() % (end - begin)];
+
+    p[k*3] = A.data[index];
+    p[k*3 +1] = B.data[index];
+    p[k*3 +2] = C.data[index];
+    k++;
+
+  }
+
+  return P;
 }
 
+//Same per pixel cost as CalculateCost(ComputeNormal(...)) summed over the sample
+//Returns early once the sum reaches bound, costs are never negative so the
+//candidate can not end up below it, evaluated is how many samples were read
+long int CalculateSampledCost(Mat& P, Mat& S, long int bound, int& evaluated) {
+
+  double Sinv[3][3];
+  if (!InvertCalibration(S, Sinv)) {
+    evaluated = 0;
+    return SINGULAR_COST;
+  }
 
+  const uchar* p = P.ptr<uchar>(0);
+  long int cost = 0;
+  int n = P.cols;
 
+  for(int start = 0; start < n; start += 256) {
 
+    int end = std::min(start + 256, n);
+
+    for(int j = start; j < end; ++j) {
+
+      int I[3] = { (int)p[j*3], (int)p[j*3 +1], (int)p[j*3 +2] };
+      double N[3];
+
+      N[0] = Sinv[0][0]*I[0] + Sinv[0][1]*I[1] + Sinv[0][2]*I[2]; 
+      N[1] = Sinv[1][0]*I[0] + Sinv[1][1]*I[1] + Sinv[1][2]*I[2]; 
+      N[2] = Sinv[2][0]*I[0] + Sinv[2][1]*I[1] + Sinv[2][2]*I[2];
+
+      double mag = sqrt(N[0]*N[0] + N[1]*N[1] + N[2]*N[2]);
+
+      //a zero or NaN normal gets the flat fill like in SolveNormalRows, which costs nothing
+      if(!(mag > 0)) continue;
+
+      uchar o0 = (uchar)(((N[2]/mag)+1)*127.5);
+      uchar o1 = (uchar)(((N[1]/mag)+1)*127.5);
+      uchar o2 = (uchar)(((N[0]/mag)+1)*127.5);
+
+      cost += 255-(int)o0;
+      cost += abs(125-(int)o1);
+      cost += abs(125-(int)o2);
+    }
+
+    if(cost >= bound) {
+      evaluated = end;
+      return cost;
+    }
+
+  }
+
+  evaluated = n;
+  return cost;
+}
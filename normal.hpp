@@ -0,0 +1,407 @@
+#ifndef NORMAL_HPP
+#define NORMAL_HPP
+
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <type_traits>
+
+#include <opencv2/core/core.hpp>
+
+#include "tune.hpp"
+
+
+/*
+  Normal solver
+
+  Light matrix helpers shared by the tools, and the per pixel kernels. One kernel per light count, input depth, output layout and threshold mode,
+  so the inner loop has no runtime branches and a fixed number of lights the
+  compiler can unroll. Pick one with SelectNormalKernel once and reuse it.
+*/
+
+//cost given to a light matrix without an inverse, above any real cost so the search never keeps one
+//(every pixel would get the flat fill, which costs nothing); headroom left for the annealing limit
+#define SINGULAR_COST (LONG_MAX/4)
+
+//Light matrices are 3x3 CV_8SC1, written and read back through at<uchar> like the search does
+//false (and Sinv all zeros) when S has no inverse
+inline bool InvertCalibration(const cv::Mat& S, double Sinv[3][3]) {
+
+  //Determinant and Inverse algorithm taken from www.thecrazyprogramer.com
+  float determinant = 0;
+  for(int i = 0; i < 3; i++) {
+    determinant = determinant + 
+    ( 
+      (int)S.at<unsigned char>(0,i)  * 
+        ( 
+          (int)S.at<unsigned char>(1,(i+1)%3)  * 
+          (int)S.at<unsigned char>(2,(i+2)%3)  - 
+          (int)S.at<unsigned char>(1,(i+2)%3)  * 
+          (int)S.at<unsigned char>(2,(i+1)%3) 
+        )
+    );      
+
+    // DONT DELETE
+    // determinant = determinant + (source[0][i] * (source[1][(i+1)%3] * source[2][(i+2)%3] - source[1][(i+2)%3] * source[2][(i+1)%3]));      
+  }
+
+  //the entries are integers, so is the determinant; the float sum above can round a zero away from 0
+  long exact = 0;
+  for(int i = 0; i < 3; i++) {
+    exact += (long)S.at<unsigned char>(0,i) *
+      ((long)S.at<unsigned char>(1,(i+1)%3) * S.at<unsigned char>(2,(i+2)%3) -
+       (long)S.at<unsigned char>(1,(i+2)%3) * S.at<unsigned char>(2,(i+1)%3));
+  }
+
+  if (exact == 0) {
+    for(int i = 0; i < 3; i++) {
+      for(int j = 0; j < 3; j++) {
+        Sinv[i][j] = 0;
+      }
+    }
+    return false;
+  }
+
+
+  for(int i = 0; i < 3; i++) {
+    for(int j = 0; j < 3; j++) {
+      Sinv[i][j] = (((int)S.at<unsigned char>( (j+1)%3, (i+1)%3 ) * (int)S.at<unsigned char>( (j+2)%3, (i+2)%3 )) - ((int)S.at<unsigned char>( (j+1)%3, (i+2)%3 ) * (int)S.at<unsigned char>( (j+2)%3, (i+1)%3 )))/determinant;
+    }
+  }
+
+  return true;
+}
+
+//one row of the light matrix per line, same layout howToScanImages reads
+inline std::string CalibrationText(const cv::Mat& S) {
+
+  std::ostringstream out;
+  for(int i = 0; i < 3; i++) {
+    out << (int)S.at<unsigned char>(i,0) << " " << (int)S.at<unsigned char>(i,1) << " " << (int)S.at<unsigned char>(i,2) << "\n";
+  }
+  return out.str();
+}
+
+inline void SaveCalibration(const cv::Mat& S, const std::string& file) {
+
+  std::ofstream out(file);
+  out << CalibrationText(S);
+
+}
+
+inline bool LoadCalibration(cv::Mat& S, const std::string& file) {
+
+  std::ifstream in(file);
+  if (!in.is_open()) {
+    return false;
+  }
+
+  for(int i = 0; i < 3; i++) {
+    for(int j = 0; j < 3; j++) {
+      int value;
+      if (!(in >> value)) {
+        return false;
+      }
+      S.at<unsigned char>(i,j) = (unsigned char)value;
+    }
+  }
+
+  return true;
+}
+
+
+//output layouts
+#define NORMAL_BGR8 0    //8 bit BGR, same encoding as the jpg
+#define NORMAL_FLOAT3 1  //float x,y,z unit vector
+#define NORMAL_XY 2      //float x,y, z is implied
+
+//I is an array of lights single channel images, Sinv the 3 x lights inverse (row major)
+//packed kernels take the single PackLights buffer in I[0] instead, the width comes from O
+typedef void (*NormalKernel)(const cv::Mat* I, cv::Mat& O, const double* Sinv, int th, int r0, int r1);
+
+
+//pixels per light in one tile of a packed row
+#define PACK_TILE 64
+
+//Interleaves the lights per row in tiles of PACK_TILE pixels, light 0 pixels 0..63,
+//light 1 pixels 0..63, .., light 0 pixels 64..127, so a kernel reads one stream
+//instead of one per light. The last tile is zero padded, P keeps I's depth
+inline cv::Mat& PackLights(const cv::Mat* I, int lights, cv::Mat& P) {
+
+  const int rows = I[0].rows;
+  const int cols = I[0].cols;
+  const int tiles = (cols + PACK_TILE - 1)/PACK_TILE;
+  const size_t elem = I[0].elemSize();
+
+  P.create(rows, tiles*PACK_TILE*lights, I[0].type());
+
+  cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range& range) {
+
+    for(int i = range.start; i < range.end; ++i) {
+
+      unsigned char* p = P.ptr<unsigned char>(i);
+
+      for(int t = 0; t < tiles; t++) {
+        int n = std::min(PACK_TILE, cols - t*PACK_TILE);
+        for(int k = 0; k < lights; k++) {
+          unsigned char* dst = p + (size_t)(t*lights + k)*PACK_TILE*elem;
+          memcpy(dst, I[k].ptr<unsigned char>(i) + (size_t)t*PACK_TILE*elem, n*elem);
+          memset(dst + n*elem, 0, (PACK_TILE - n)*elem);
+        }
+      }
+    }
+
+  });
+
+  return P;
+}
+
+
+template<int N, typename T, int Out, bool Threshold, bool Packed>
+void SolveNormalRows(const cv::Mat* I, cv::Mat& O, const double* Sinv, int th, int r0, int r1) {
+
+  //8 bit output keeps double math so renders match the search costs bit for bit
+  typedef typename std::conditional<Out == NORMAL_BGR8, double, float>::type Real;
+
+  Real s[3][N];
+  for(int r = 0; r < 3; r++) {
+    for(int k = 0; k < N; k++) {
+      s[r][k] = (Real)Sinv[r*N + k];
+    }
+  }
+
+  const int nCols = O.cols;
+
+  for(int i = r0; i < r1; ++i) {
+
+    unsigned char* o8 = O.ptr<unsigned char>(i);
+    float* of = O.ptr<float>(i);
+
+    for(int j0 = 0; j0 < nCols; j0 += PACK_TILE) {
+
+      const T* p[N];
+      for(int k = 0; k < N; k++) {
+        p[k] = Packed ? I[0].ptr<T>(i) + j0*N + k*PACK_TILE : I[k].ptr<T>(i) + j0;
+      }
+
+      const int tileCols = std::min(PACK_TILE, nCols - j0);
+
+      for(int t = 0; t < tileCols; ++t) {
+
+        const int j = j0 + t;
+
+        Real X0 = 0, X1 = 0, X2 = 0;
+        bool keep = true;
+
+        for(int k = 0; k < N; k++) {
+          Real v = (Real)p[k][t];
+          X0 += s[0][k]*v;
+          X1 += s[1][k]*v;
+          X2 += s[2][k]*v;
+          if(Threshold) keep = keep && (int)p[k][t] > th;
+        }
+
+        Real mag = std::sqrt(X0*X0 + X1*X1 + X2*X2);
+        keep = keep && mag > 0;
+
+        if(Out == NORMAL_BGR8) {
+
+          o8[j*3] = keep ? (unsigned char)(((X2/mag)+1)*127.5) : 255;
+          o8[j*3 +1] = keep ? (unsigned char)(((X1/mag)+1)*127.5) : 125;
+          o8[j*3 +2] = keep ? (unsigned char)(((X0/mag)+1)*127.5) : 125;
+
+        } else if(Out == NORMAL_FLOAT3) {
+
+          //flat fill faces the camera
+          of[j*3] = keep ? (float)(X0/mag) : 0;
+          of[j*3 +1] = keep ? (float)(X1/mag) : 0;
+          of[j*3 +2] = keep ? (float)(X2/mag) : 1;
+
+        } else {
+
+          of[j*2] = keep ? (float)(X0/mag) : 0;
+          of[j*2 +1] = keep ? (float)(X1/mag) : 0;
+
+        }
+
+      }
+    }
+  }
+}
+
+
+inline int NormalOutputType(int output) {
+
+  if(output == NORMAL_BGR8) return CV_8UC3;
+  if(output == NORMAL_FLOAT3) return CV_32FC3;
+  return CV_32FC2;
+}
+
+//Returns NULL when the combination is not instantiated, packed kernels read a PackLights buffer
+inline NormalKernel SelectNormalKernel(int lights, int depth, int output, bool threshold, bool packed = false) {
+
+#define NORMAL_KERNEL_CASE(n, T, d, out) \
+  if(lights == n && depth == d && output == out) { \
+    if(packed) return threshold ? &SolveNormalRows<n, T, out, true, true> : &SolveNormalRows<n, T, out, false, true>; \
+    return threshold ? &SolveNormalRows<n, T, out, true, false> : &SolveNormalRows<n, T, out, false, false>; \
+  }
+
+  NORMAL_KERNEL_CASE(3, unsigned char, CV_8U, NORMAL_BGR8)
+  NORMAL_KERNEL_CASE(3, unsigned char, CV_8U, NORMAL_FLOAT3)
+  NORMAL_KERNEL_CASE(3, unsigned char, CV_8U, NORMAL_XY)
+  NORMAL_KERNEL_CASE(3, unsigned short, CV_16U, NORMAL_BGR8)
+  NORMAL_KERNEL_CASE(3, unsigned short, CV_16U, NORMAL_FLOAT3)
+  NORMAL_KERNEL_CASE(3, unsigned short, CV_16U, NORMAL_XY)
+  NORMAL_KERNEL_CASE(4, unsigned char, CV_8U, NORMAL_BGR8)
+  NORMAL_KERNEL_CASE(4, unsigned char, CV_8U, NORMAL_FLOAT3)
+  NORMAL_KERNEL_CASE(4, unsigned char, CV_8U, NORMAL_XY)
+  NORMAL_KERNEL_CASE(4, unsigned short, CV_16U, NORMAL_BGR8)
+  NORMAL_KERNEL_CASE(4, unsigned short, CV_16U, NORMAL_FLOAT3)
+  NORMAL_KERNEL_CASE(4, unsigned short, CV_16U, NORMAL_XY)
+
+#undef NORMAL_KERNEL_CASE
+
+  return NULL;
+}
+
+//Runs kernel over all rows of I in parallel, O is (re)allocated for the output layout
+inline cv::Mat& RunNormalKernel(NormalKernel kernel, int output, const cv::Mat* I, cv::Mat& O, const double* Sinv, int th) {
+
+  O.create(I[0].rows, I[0].cols, NormalOutputType(output));
+
+  cv::parallel_for_(cv::Range(0, I[0].rows), [&](const cv::Range& range) {
+    kernel(I, O, Sinv, th, range.start, range.end);
+  }, TuneStripes(I[0].rows, Tuning().normalStripes));
+
+  return O;
+}
+
+//Same for a packed kernel, P from PackLights over images cols wide
+inline cv::Mat& RunPackedNormalKernel(NormalKernel kernel, int output, const cv::Mat& P, int cols, cv::Mat& O, const double* Sinv, int th) {
+
+  O.create(P.rows, cols, NormalOutputType(output));
+
+  cv::parallel_for_(cv::Range(0, P.rows), [&](const cv::Range& range) {
+    kernel(&P, O, Sinv, th, range.start, range.end);
+  }, TuneStripes(P.rows, Tuning().normalStripes));
+
+  return O;
+}
+
+
+//candidates scored per pass by CalculateBatchCost, one per entry of the 3x3 light matrix
+#define BATCH_SIZE 9
+
+//Scores K calibrations in one pass over 3 lights, each pixel is loaded once and run
+//through all K inverses. Per pixel cost is the same as CalculateCost on a NORMAL_BGR8
+//render, pixels failing th cost 0 for every candidate and are skipped
+template<int K, bool Packed>
+void BatchCostRows(const cv::Mat* I, int nCols, const double* Sinv, int th, int r0, int r1, long* cost) {
+
+  double s[K][9];
+  long sum[K];
+  for(int c = 0; c < K; c++) {
+    for(int k = 0; k < 9; k++) {
+      s[c][k] = Sinv[c*9 + k];
+    }
+    sum[c] = 0;
+  }
+
+  for(int i = r0; i < r1; ++i) {
+
+    for(int j0 = 0; j0 < nCols; j0 += PACK_TILE) {
+
+      const unsigned char* p1 = Packed ? I[0].ptr<unsigned char>(i) + j0*3 : I[0].ptr<unsigned char>(i) + j0;
+      const unsigned char* p2 = Packed ? p1 + PACK_TILE : I[1].ptr<unsigned char>(i) + j0;
+      const unsigned char* p3 = Packed ? p1 + 2*PACK_TILE : I[2].ptr<unsigned char>(i) + j0;
+
+      const int tileCols = std::min(PACK_TILE, nCols - j0);
+
+      for(int t = 0; t < tileCols; ++t) {
+
+        if(!(p1[t] > th && p2[t] > th && p3[t] > th)) {
+          continue;
+        }
+
+        double v0 = p1[t], v1 = p2[t], v2 = p3[t];
+
+        for(int c = 0; c < K; c++) {
+
+          double X0 = s[c][0]*v0 + s[c][1]*v1 + s[c][2]*v2;
+          double X1 = s[c][3]*v0 + s[c][4]*v1 + s[c][5]*v2;
+          double X2 = s[c][6]*v0 + s[c][7]*v1 + s[c][8]*v2;
+
+          double mag = std::sqrt(X0*X0 + X1*X1 + X2*X2);
+          if(!(mag > 0)) {
+            continue;
+          }
+
+          int o0 = (unsigned char)(((X2/mag)+1)*127.5);
+          int o1 = (unsigned char)(((X1/mag)+1)*127.5);
+          int o2 = (unsigned char)(((X0/mag)+1)*127.5);
+
+          sum[c] += (255 - o0) + std::abs(125 - o1) + std::abs(125 - o2);
+        }
+
+      }
+    }
+  }
+
+  for(int c = 0; c < K; c++) {
+    cost[c] = sum[c];
+  }
+}
+
+//Costs of count calibrations given as count row major 3x3 inverses, BATCH_SIZE per pass
+//rows are split in stripes per thread and the partial sums added at the end
+//packed reads I[0] as a PackLights buffer over images cols wide, I[1] and I[2] are unused
+template<bool Packed>
+void BatchCost(const cv::Mat* I, int cols, const double* Sinv, int count, int th, long* cost) {
+
+  const int rows = I[0].rows;
+  const int stripes = TuneStripes(rows, Tuning().batchStripes);
+
+  for(int first = 0; first < count; first += BATCH_SIZE) {
+
+    //short batches repeat the last candidate, the extra costs are dropped
+    double s[BATCH_SIZE*9];
+    for(int c = 0; c < BATCH_SIZE; c++) {
+      int from = std::min(first + c, count - 1);
+      for(int k = 0; k < 9; k++) {
+        s[c*9 + k] = Sinv[from*9 + k];
+      }
+    }
+
+    std::vector<long> partial(stripes*BATCH_SIZE, 0);
+
+    cv::parallel_for_(cv::Range(0, stripes), [&](const cv::Range& range) {
+      for(int t = range.start; t < range.end; t++) {
+        BatchCostRows<BATCH_SIZE, Packed>(I, cols, s, th, t*rows/stripes, (t+1)*rows/stripes, &partial[t*BATCH_SIZE]);
+      }
+    });
+
+    for(int c = 0; c < BATCH_SIZE && first + c < count; c++) {
+      cost[first + c] = 0;
+      for(int t = 0; t < stripes; t++) {
+        cost[first + c] += partial[t*BATCH_SIZE + c];
+      }
+    }
+
+  }
+}
+
+inline void CalculateBatchCost(const cv::Mat* I, const double* Sinv, int count, int th, long* cost) {
+  BatchCost<false>(I, I[0].cols, Sinv, count, th, cost);
+}
+
+inline void CalculatePackedBatchCost(const cv::Mat& P, int cols, const double* Sinv, int count, int th, long* cost) {
+  BatchCost<true>(&P, cols, Sinv, count, th, cost);
+}
+
+#endif
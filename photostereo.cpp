@@ -0,0 +1,365 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <new>
+#include <string>
+
+#include <opencv2/core/core.hpp>
+
+#include "albedo.hpp"
+#include "highlight.hpp"
+#include "normal.hpp"
+#include "sphere.hpp"
+
+
+using namespace cv;
+using namespace std;
+
+
+/*
+  Python module
+
+  The solver, albedo, highlight and sphere calibration kernels for Python
+  tools. Images go in as anything with the buffer protocol (NumPy uint8
+  arrays, rows x cols or rows x cols x 3) and are read in place. Results
+  come back as photostereo.Image objects that export their pixels through
+  the buffer protocol, np.asarray(result) wraps them without a copy. The
+  GIL is released while the kernels run, so calls from several threads
+  run side by side.
+
+  Build:
+    g++ -O3 -shared -fPIC $(python3-config --includes) photostereo.cpp \
+      -o photostereo$(python3-config --extension-suffix) $(pkg-config --cflags --libs opencv4)
+*/
+
+
+//Image: owns a Mat, exports it read/write through the buffer protocol
+
+typedef struct {
+  PyObject_HEAD
+  Mat mat;
+  Py_ssize_t shape[3];
+  Py_ssize_t strides[3];
+} ImageObject;
+
+static void Image_dealloc(ImageObject* self) {
+  self->mat.~Mat();
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static int Image_getbuffer(ImageObject* self, Py_buffer* view, int flags) {
+
+  const Mat& m = self->mat;
+  int ndim = m.channels() == 1 ? 2 : 3;
+
+  //always writable; without strides, or asked to be contiguous, only a continuous Mat
+  //can be handed out as is, rows are never laid out column major
+  bool strided = (flags & PyBUF_STRIDES) == PyBUF_STRIDES;
+  bool contiguous = (flags & PyBUF_C_CONTIGUOUS) == PyBUF_C_CONTIGUOUS || (flags & PyBUF_ANY_CONTIGUOUS) == PyBUF_ANY_CONTIGUOUS;
+  if ((flags & PyBUF_F_CONTIGUOUS) == PyBUF_F_CONTIGUOUS || ((!strided || contiguous) && !m.isContinuous())) {
+    PyErr_SetString(PyExc_BufferError, "photostereo.Image is a row major image, request strides or C contiguity");
+    view->obj = NULL;
+    return -1;
+  }
+
+  self->shape[0] = m.rows;
+  self->shape[1] = m.cols;
+  self->shape[2] = m.channels();
+  self->strides[0] = (Py_ssize_t)m.step;
+  self->strides[1] = m.elemSize();
+  self->strides[2] = m.elemSize1();
+
+  view->obj = (PyObject*)self;
+  view->buf = m.data;
+  view->len = (Py_ssize_t)m.step*m.rows;
+  view->readonly = 0;
+  view->itemsize = m.elemSize1();
+  view->format = (flags & PyBUF_FORMAT) ? (char*)(m.depth() == CV_32F ? "f" : "B") : NULL;
+  view->ndim = (flags & PyBUF_ND) == PyBUF_ND ? ndim : 1;
+  view->shape = (flags & PyBUF_ND) == PyBUF_ND ? self->shape : NULL;
+  view->strides = strided ? self->strides : NULL;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+
+  Py_INCREF(self);
+  return 0;
+}
+
+static PyBufferProcs Image_as_buffer = {
+  (getbufferproc)Image_getbuffer,
+  NULL,
+};
+
+static PyTypeObject ImageType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "photostereo.Image",
+};
+
+static PyObject* WrapImage(Mat& m) {
+
+  ImageObject* self = (ImageObject*)ImageType.tp_alloc(&ImageType, 0);
+  if (!self) {
+    return NULL;
+  }
+
+  new (&self->mat) Mat(m);
+  return (PyObject*)self;
+}
+
+
+//Input images: a view on the caller's buffer, released with the view
+
+struct InputImage {
+
+  Py_buffer view;
+  Mat mat;
+  bool held;
+
+  InputImage() : held(false) {}
+  ~InputImage() { if (held) PyBuffer_Release(&view); }
+
+  //uint8, 2d (gray) or 3d with 3 channels, read in place when rows are padded at most,
+  //copied row major first when not (reversed or transposed views, pixels not packed)
+  bool open(PyObject* obj, int channels, const char* name) {
+
+    if (PyObject_GetBuffer(obj, &view, PyBUF_STRIDES | PyBUF_FORMAT) != 0) {
+      return false;
+    }
+    held = true;
+
+    int ch = view.ndim == 3 ? (int)view.shape[2] : 1;
+    bool byte = view.itemsize == 1 && (!view.format || string(view.format) == "B");
+
+    if (!byte || view.ndim < 2 || view.ndim > 3 || ch != channels) {
+      PyErr_Format(PyExc_ValueError, "%s has to be a uint8 array of shape (rows, cols%s)", name, channels == 3 ? ", 3" : "");
+      return false;
+    }
+
+    const int rows = (int)view.shape[0], cols = (int)view.shape[1];
+    if (view.strides[0] >= (Py_ssize_t)cols*ch && view.strides[1] == ch && (view.ndim == 2 || view.strides[2] == 1)) {
+      mat = Mat(rows, cols, CV_8UC(ch), view.buf, (size_t)view.strides[0]);
+      return true;
+    }
+
+    mat.create(rows, cols, CV_8UC(ch));
+    return PyBuffer_ToContiguous(mat.data, &view, (Py_ssize_t)rows*cols*ch, 'C') == 0;
+  }
+};
+
+
+//normal(a, b, c, calibration, threshold, float=False)
+//calibration is the 3x3 light matrix as saved in calibration.txt
+static PyObject* ps_normal(PyObject* self, PyObject* args, PyObject* kwargs) {
+
+  static const char* keywords[] = { "a", "b", "c", "calibration", "threshold", "float", NULL };
+  PyObject *pa, *pb, *pc, *calibration;
+  int th;
+  int floatOut = 0;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOOi|p", (char**)keywords, &pa, &pb, &pc, &calibration, &th, &floatOut)) {
+    return NULL;
+  }
+
+  InputImage in[3];
+  if (!in[0].open(pa, 1, "a") || !in[1].open(pb, 1, "b") || !in[2].open(pc, 1, "c")) {
+    return NULL;
+  }
+
+  if (in[0].mat.size() != in[1].mat.size() || in[0].mat.size() != in[2].mat.size()) {
+    PyErr_SetString(PyExc_ValueError, "a, b and c have to be the same size");
+    return NULL;
+  }
+
+  PyObject* seq = PySequence_Fast(calibration, "calibration has to be a 3x3 sequence");
+  if (!seq) {
+    return NULL;
+  }
+
+  Mat S(3, 3, CV_8SC1, Scalar(0));
+  bool ok = PySequence_Fast_GET_SIZE(seq) == 3;
+
+  for(int i = 0; i < 3 && ok; i++) {
+    PyObject* row = PySequence_Fast(PySequence_Fast_GET_ITEM(seq, i), "calibration has to be a 3x3 sequence");
+    ok = row && PySequence_Fast_GET_SIZE(row) == 3;
+    for(int j = 0; j < 3 && ok; j++) {
+      long value = PyLong_AsLong(PySequence_Fast_GET_ITEM(row, j));
+      ok = !(value == -1 && PyErr_Occurred());
+      S.at<unsigned char>(i,j) = (unsigned char)value;
+    }
+    Py_XDECREF(row);
+  }
+  Py_DECREF(seq);
+
+  if (!ok) {
+    if (!PyErr_Occurred()) {
+      PyErr_SetString(PyExc_ValueError, "calibration has to be 3x3 integers");
+    }
+    return NULL;
+  }
+
+  double Sinv[3][3];
+  if (!InvertCalibration(S, Sinv)) {
+    PyErr_SetString(PyExc_ValueError, "calibration has no inverse");
+    return NULL;
+  }
+
+  int output = floatOut ? NORMAL_FLOAT3 : NORMAL_BGR8;
+  NormalKernel kernel = SelectNormalKernel(3, CV_8U, output, true);
+  Mat I[3] = { in[0].mat, in[1].mat, in[2].mat };
+  Mat O;
+
+  Py_BEGIN_ALLOW_THREADS
+  RunNormalKernel(kernel, output, I, O, Sinv[0], th);
+  Py_END_ALLOW_THREADS
+
+  return WrapImage(O);
+}
+
+//albedo(a, b, c), per channel average of three images of the same shape
+static PyObject* ps_albedo(PyObject* self, PyObject* args) {
+
+  PyObject *pa, *pb, *pc;
+  if (!PyArg_ParseTuple(args, "OOO", &pa, &pb, &pc)) {
+    return NULL;
+  }
+
+  InputImage in[3];
+  int ch = 3;
+  Py_buffer probe;
+  if (PyObject_GetBuffer(pa, &probe, PyBUF_STRIDES) == 0) {
+    ch = probe.ndim == 3 ? (int)probe.shape[2] : 1;
+    PyBuffer_Release(&probe);
+  } else {
+    return NULL;
+  }
+
+  if (!in[0].open(pa, ch, "a") || !in[1].open(pb, ch, "b") || !in[2].open(pc, ch, "c")) {
+    return NULL;
+  }
+
+  if (in[0].mat.size() != in[1].mat.size() || in[0].mat.size() != in[2].mat.size()) {
+    PyErr_SetString(PyExc_ValueError, "a, b and c have to be the same size");
+    return NULL;
+  }
+
+  Mat O(in[0].mat.rows, in[0].mat.cols, in[0].mat.type());
+
+  Py_BEGIN_ALLOW_THREADS
+  //AverageImages walks rows of A, B and C, padded inputs are fine
+  AverageImages(in[0].mat, in[1].mat, in[2].mat, O);
+  Py_END_ALLOW_THREADS
+
+  return WrapImage(O);
+}
+
+//highlight(image, threshold), white where all 3 channels of a BGR image are above threshold
+static PyObject* ps_highlight(PyObject* self, PyObject* args) {
+
+  PyObject* pi;
+  int th;
+  if (!PyArg_ParseTuple(args, "Oi", &pi, &th)) {
+    return NULL;
+  }
+
+  InputImage in;
+  if (!in.open(pi, 3, "image")) {
+    return NULL;
+  }
+
+  Mat O;
+
+  Py_BEGIN_ALLOW_THREADS
+  GetHighlight(in.mat, th, O);
+  Py_END_ALLOW_THREADS
+
+  return WrapImage(O);
+}
+
+//sphere_calibration(mask, a, b, c), mask is the binarized sphere (255 inside)
+//Returns the 3 light vectors as ((x, y, z), ...) like calibrate prints them, None if no sphere
+static PyObject* ps_sphere_calibration(PyObject* self, PyObject* args) {
+
+  PyObject *pm, *pa, *pb, *pc;
+  if (!PyArg_ParseTuple(args, "OOOO", &pm, &pa, &pb, &pc)) {
+    return NULL;
+  }
+
+  InputImage mask, in[3];
+  if (!mask.open(pm, 1, "mask") || !in[0].open(pa, 1, "a") || !in[1].open(pb, 1, "b") || !in[2].open(pc, 1, "c")) {
+    return NULL;
+  }
+
+  int params[3];
+  double n[3][3];
+  bool found;
+
+  Py_BEGIN_ALLOW_THREADS
+  found = FindSphere(mask.mat, params);
+  if (found) {
+    for(int k = 0; k < 3; k++) {
+      SphereLight(in[k].mat, params, n[k]);
+    }
+  }
+  Py_END_ALLOW_THREADS
+
+  if (!found) {
+    Py_RETURN_NONE;
+  }
+
+  return Py_BuildValue("((ddd)(ddd)(ddd))", n[0][0], n[0][1], n[0][2], n[1][0], n[1][1], n[1][2], n[2][0], n[2][1], n[2][2]);
+}
+
+//use_tune_profile(), applies the profile's thread count to OpenCV for the whole process
+//Returns the thread count OpenCV runs with afterwards
+static PyObject* ps_use_tune_profile(PyObject* self, PyObject* args) {
+
+  if (Tuning().threads > 0) {
+    cv::setNumThreads(Tuning().threads);
+  }
+
+  return PyLong_FromLong(cv::getNumThreads());
+}
+
+
+static PyMethodDef methods[] = {
+  { "normal", (PyCFunction)(void(*)(void))ps_normal, METH_VARARGS | METH_KEYWORDS,
+    "normal(a, b, c, calibration, threshold, float=False) -> Image\n"
+    "Normal map of three gray images, 8 bit BGR or float x,y,z" },
+  { "albedo", ps_albedo, METH_VARARGS, "albedo(a, b, c) -> Image\nPer channel average of three images" },
+  { "highlight", ps_highlight, METH_VARARGS, "highlight(image, threshold) -> Image\nWhite where all channels are above threshold" },
+  { "sphere_calibration", ps_sphere_calibration, METH_VARARGS,
+    "sphere_calibration(mask, a, b, c) -> ((x, y, z), ...)\nLight vectors from the highlights on a calibration sphere" },
+  { "use_tune_profile", ps_use_tune_profile, METH_NOARGS,
+    "use_tune_profile() -> int\nSets OpenCV's thread count for the process from this host's profile" },
+  { NULL, NULL, 0, NULL }
+};
+
+static PyModuleDef module = {
+  PyModuleDef_HEAD_INIT, "photostereo", "Photometric stereo kernels working on buffers in place", -1, methods,
+};
+
+PyMODINIT_FUNC PyInit_photostereo(void) {
+
+  //stripes and layout only, the thread count is the host process's until use_tune_profile() is called
+  UseTuneProfile(false);
+
+  ImageType.tp_basicsize = sizeof(ImageObject);
+  ImageType.tp_dealloc = (destructor)Image_dealloc;
+  ImageType.tp_as_buffer = &Image_as_buffer;
+  ImageType.tp_flags = Py_TPFLAGS_DEFAULT;
+  ImageType.tp_doc = "Result image, use np.asarray(image) to get a NumPy view";
+
+  if (PyType_Ready(&ImageType) < 0) {
+    return NULL;
+  }
+
+  PyObject* m = PyModule_Create(&module);
+  if (!m) {
+    return NULL;
+  }
+
+  Py_INCREF(&ImageType);
+  PyModule_AddObject(m, "Image", (PyObject*)&ImageType);
+
+  return m;
+}
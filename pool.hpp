@@ -0,0 +1,210 @@
+#ifndef POOL_HPP
+#define POOL_HPP
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include <opencv2/core/core.hpp>
+
+
+/*
+  Buffer pool
+
+  A cv::MatAllocator that keeps large image buffers around after they are
+  released and hands them back out for the next allocation of the same size
+  class. Installed as the default allocator, so the Mats OpenCV allocates
+  inside imread, pyrDown, remap, ... come out of the pool too. After the
+  first set of a batch every full size buffer is a reuse.
+
+  Buffers under POOL_MIN_BYTES go straight to fastMalloc. Cached memory is
+  capped, past the cap released buffers are freed for real. Long running
+  tools (capture) cache up to POOL_BATCH_MB, one shot tools only reuse
+  within their own run and keep POOL_ONESHOT_MB, about two full size
+  working buffers of a large scan, so the pool never holds gigabytes of
+  touched memory a single run will not ask for again.
+*/
+
+#define POOL_BATCH_MB 4096
+#define POOL_ONESHOT_MB 256
+
+#define POOL_MIN_BYTES (1 << 20)
+#define POOL_HUGE_PAGE (2 << 20)
+
+#if CV_VERSION_MAJOR >= 4
+typedef cv::AccessFlag PoolAccessFlag;
+#else
+typedef int PoolAccessFlag;
+#endif
+
+class BufferPool : public cv::MatAllocator {
+
+public:
+
+  BufferPool(size_t capBytes, bool hugePages) : cap(capBytes), huge(hugePages), cached(0), fresh(0), reused(0) {}
+
+  cv::UMatData* allocate(int dims, const int* sizes, int type, void* data0, size_t* step, PoolAccessFlag, cv::UMatUsageFlags) const {
+
+    //same layout rules as OpenCV's own StdMatAllocator
+    size_t total = CV_ELEM_SIZE(type);
+    for(int i = dims-1; i >= 0; i--) {
+      if(step) {
+        if(data0 && step[i] != CV_AUTOSTEP) {
+          total = step[i];
+        } else {
+          step[i] = total;
+        }
+      }
+      total *= sizes[i];
+    }
+
+    cv::UMatData* u = new cv::UMatData(this);
+    u->size = total;
+
+    if(data0) {
+      u->data = u->origdata = (unsigned char*)data0;
+      u->flags |= cv::UMatData::USER_ALLOCATED;
+      return u;
+    }
+
+    u->data = u->origdata = (unsigned char*)take(total);
+    return u;
+  }
+
+  bool allocate(cv::UMatData* u, PoolAccessFlag, cv::UMatUsageFlags) const {
+    return u != NULL;
+  }
+
+  void deallocate(cv::UMatData* u) const {
+
+    if(!u) {
+      return;
+    }
+
+    if(!(u->flags & cv::UMatData::USER_ALLOCATED)) {
+      give(u->origdata, u->size);
+      u->origdata = 0;
+    }
+
+    delete u;
+  }
+
+  void printStats() const {
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::cout << "Buffer pool: " << fresh << " large allocations, " << reused << " reused, "
+              << (cached >> 20) << " MB cached" << std::endl;
+  }
+
+private:
+
+  size_t cap;
+  bool huge;
+
+  mutable std::mutex mutex;
+  mutable std::map<size_t, std::vector<void*> > buckets;
+  mutable size_t cached;
+  mutable long fresh;
+  mutable long reused;
+
+  //a few size classes per power of two, at most 1/8 wasted
+  static size_t BucketSize(size_t size) {
+
+    size_t p = 1;
+    while(p < size) p <<= 1;
+
+    size_t q = std::max(p / 8, (size_t)4096);
+    return (size + q - 1) / q * q;
+  }
+
+  void* take(size_t size) const {
+
+    if(size < POOL_MIN_BYTES) {
+      return cv::fastMalloc(size);
+    }
+
+    size_t bucket = BucketSize(size);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::vector<void*>& list = buckets[bucket];
+      if(!list.empty()) {
+        void* p = list.back();
+        list.pop_back();
+        cached -= bucket;
+        reused++;
+        return p;
+      }
+      fresh++;
+    }
+
+    return mapBuffer(bucket);
+  }
+
+  void give(void* p, size_t size) const {
+
+    if(size < POOL_MIN_BYTES) {
+      cv::fastFree(p);
+      return;
+    }
+
+    size_t bucket = BucketSize(size);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if(cached + bucket <= cap) {
+        buckets[bucket].push_back(p);
+        cached += bucket;
+        return;
+      }
+    }
+
+    munmap(p, bucket);
+  }
+
+  //large buffers come straight from the kernel, page aligned, optionally on huge pages
+  void* mapBuffer(size_t bucket) const {
+
+    void* p = mmap(NULL, bucket, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+
+#ifdef MADV_HUGEPAGE
+    if(huge && bucket >= POOL_HUGE_PAGE) {
+      madvise(p, bucket, MADV_HUGEPAGE);
+    }
+#endif
+
+    return p;
+  }
+};
+
+//Installs the pool as the default Mat allocator, call first thing in main
+//PS_POOL_MB overrides the cap on the cached memory (defaultMB), PS_POOL_HUGEPAGES=1 asks for huge pages
+inline BufferPool* UseBufferPool(size_t defaultMB = POOL_ONESHOT_MB) {
+
+  static BufferPool* pool = NULL;
+
+  if(!pool) {
+    const char* mb = getenv("PS_POOL_MB");
+    const char* huge = getenv("PS_POOL_HUGEPAGES");
+
+    size_t cap = (size_t)(mb ? atol(mb) : defaultMB) << 20;
+
+    //never deleted, Mats can outlive main's locals
+    pool = new BufferPool(cap, huge && atoi(huge) != 0);
+    cv::Mat::setDefaultAllocator(pool);
+  }
+
+  return pool;
+}
+
+#endif
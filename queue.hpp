@@ -0,0 +1,236 @@
+#ifndef QUEUE_HPP
+#define QUEUE_HPP
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+
+/*
+  Work queue
+
+  A directory of plain files, every state change is one rename so it is
+  atomic on a local disk and on a filesystem shared by several nodes:
+
+    pending/[id]~[attempt]                  waiting, holds the command to run
+    running/[id]~[attempt]~[host]~[pid]     claimed by a worker
+    done/[id]                               finished
+    failed/[id]                             gave up after the last attempt
+    logs/[id]                               output of every attempt
+
+  Two workers renaming the same pending item can not both succeed, the one
+  that gets ENOENT moves on to the next item. A worker touches its running
+  file while the command runs, items whose file has not been touched for a
+  lease are taken back to pending (with one more attempt) by whichever
+  worker notices first, so a crashed worker or node only costs a lease.
+  Leases are timed by the queue's filesystem, not by the worker's clock:
+  the age of a running file is measured against a probe file the worker
+  touches in tmp/ just before, so nodes with skewed clocks agree. Entries
+  whose names do not parse are moved to failed/ with a message.
+  Commands have to be safe to run again, a retry redoes the item.
+*/
+
+#define QUEUE_ATTEMPTS 3
+#define QUEUE_LEASE 120
+#define QUEUE_HEARTBEAT 10
+
+struct WorkItem {
+  std::string id;
+  int attempt;
+  std::string command;
+  std::string running;
+};
+
+
+//attempt count of a queue name, false when it is not a plain number
+inline bool ParseAttempt(const std::string& s, int& attempt) {
+
+  char* end = NULL;
+  long v = strtol(s.c_str(), &end, 10);
+  if (s.empty() || *end != '\0' || v < 0 || v > 1000000) {
+    return false;
+  }
+  attempt = (int)v;
+  return true;
+}
+
+//Out of the way into failed/, someone else may have done it already
+inline void RejectWorkItem(const std::string& queue, const std::string& dir, const std::string& name) {
+
+  std::cout << "Skipping malformed queue entry " << dir << "/" << name << std::endl;
+  rename((queue + "/" + dir + "/" + name).c_str(), (queue + "/failed/" + name).c_str());
+}
+
+//Current time on the queue's filesystem, the mtime of a probe file touched now
+inline bool QueueTime(const std::string& queue, time_t& now) {
+
+  char host[256] = { 0 };
+  gethostname(host, sizeof(host) - 1);
+  std::string probe = queue + "/tmp/clock~" + host + "~" + std::to_string(getpid());
+
+  int fd = open(probe.c_str(), O_WRONLY | O_CREAT, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  close(fd);
+
+  struct stat st;
+  bool ok = utime(probe.c_str(), NULL) == 0 && stat(probe.c_str(), &st) == 0;
+  unlink(probe.c_str());
+
+  now = ok ? st.st_mtime : 0;
+  return ok;
+}
+
+inline std::vector<std::string> ListQueue(const std::string& dir) {
+
+  std::vector<std::string> names;
+
+  DIR* d = opendir(dir.c_str());
+  if (!d) {
+    return names;
+  }
+
+  struct dirent* entry;
+  while((entry = readdir(d)) != NULL) {
+    if (entry->d_name[0] != '.') {
+      names.push_back(entry->d_name);
+    }
+  }
+
+  closedir(d);
+
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+inline bool CreateQueue(const std::string& queue) {
+
+  const char* dirs[] = { "", "/pending", "/running", "/done", "/failed", "/logs", "/tmp" };
+  for(int k = 0; k < 7; k++) {
+    struct stat st;
+    std::string dir = queue + dirs[k];
+    if (mkdir(dir.c_str(), 0755) != 0 && (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+//Written under tmp/ first, the item only shows up in pending/ complete
+inline bool AddWorkItem(const std::string& queue, const std::string& id, const std::string& command) {
+
+  std::string tmp = queue + "/tmp/" + id;
+  {
+    std::ofstream out(tmp);
+    out << command << "\n";
+    if (!out.good()) {
+      return false;
+    }
+  }
+
+  return rename(tmp.c_str(), (queue + "/pending/" + id + "~0").c_str()) == 0;
+}
+
+//Takes the first pending item nobody else took, false when there is none left
+inline bool ClaimWorkItem(const std::string& queue, const std::string& worker, WorkItem& item) {
+
+  std::vector<std::string> pending = ListQueue(queue + "/pending");
+
+  for(size_t k = 0; k < pending.size(); k++) {
+
+    size_t tilde = pending[k].find('~');
+    int attempt;
+    if (tilde == std::string::npos || !ParseAttempt(pending[k].substr(tilde + 1), attempt)) {
+      RejectWorkItem(queue, "pending", pending[k]);
+      continue;
+    }
+
+    //rename keeps the mtime, touched first so the lease starts now and not when the item was queued,
+    //an item that waited longer than a lease would otherwise look stale the moment it is claimed
+    std::string from = queue + "/pending/" + pending[k];
+    std::string running = pending[k] + "~" + worker;
+    if (utime(from.c_str(), NULL) != 0 || rename(from.c_str(), (queue + "/running/" + running).c_str()) != 0) {
+      continue;
+    }
+    utime((queue + "/running/" + running).c_str(), NULL);
+
+    item.id = pending[k].substr(0, tilde);
+    item.attempt = attempt;
+    item.running = running;
+
+    std::ifstream in(queue + "/running/" + running);
+    std::getline(in, item.command);
+    return true;
+  }
+
+  return false;
+}
+
+//Keeps the lease of a claimed item, false once someone took it back
+inline bool TouchWorkItem(const std::string& queue, const WorkItem& item) {
+  return utime((queue + "/running/" + item.running).c_str(), NULL) == 0;
+}
+
+inline bool CompleteWorkItem(const std::string& queue, const WorkItem& item) {
+  return rename((queue + "/running/" + item.running).c_str(), (queue + "/done/" + item.id).c_str()) == 0;
+}
+
+//Back to pending for another attempt, or into failed/ after the last one
+inline bool RetryWorkItem(const std::string& queue, const std::string& running, const std::string& id, int attempt, int attempts) {
+
+  std::string to = attempt + 1 < attempts ? queue + "/pending/" + id + "~" + std::to_string(attempt + 1) : queue + "/failed/" + id;
+  if (rename((queue + "/running/" + running).c_str(), to.c_str()) != 0) {
+    return false;
+  }
+  utime(to.c_str(), NULL);
+  return true;
+}
+
+//Running items not touched for lease seconds go back to pending, returns how many this call took back
+inline int RequeueStale(const std::string& queue, int lease, int attempts) {
+
+  std::vector<std::string> running = ListQueue(queue + "/running");
+  int requeued = 0;
+
+  //a heartbeat landing after the probe only makes its item look younger
+  time_t now;
+  if (running.empty() || !QueueTime(queue, now)) {
+    return 0;
+  }
+
+  for(size_t k = 0; k < running.size(); k++) {
+
+    size_t a = running[k].find('~');
+    size_t b = a == std::string::npos ? a : running[k].find('~', a + 1);
+    int attempt;
+    if (b == std::string::npos || !ParseAttempt(running[k].substr(a + 1, b - a - 1), attempt)) {
+      RejectWorkItem(queue, "running", running[k]);
+      continue;
+    }
+
+    struct stat st;
+    if (stat((queue + "/running/" + running[k]).c_str(), &st) != 0 || now - st.st_mtime < lease) {
+      continue;
+    }
+
+    if (RetryWorkItem(queue, running[k], running[k].substr(0, a), attempt, attempts)) {
+      requeued++;
+    }
+  }
+
+  return requeued;
+}
+
+#endif
@@ -0,0 +1,229 @@
+#ifndef RAWIMAGE_HPP
+#define RAWIMAGE_HPP
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <opencv2/core/core.hpp>
+
+
+/*
+  Raw image container
+
+  A fixed header followed by the pixel rows, no compression and no padding
+  between rows. Pixels start on a page boundary so the data can be mapped
+  straight into a cv::Mat.
+
+    0   char[8]  magic "PSRAW01"
+    8   int32    rows
+    12  int32    cols
+    16  int32    OpenCV type (CV_8UC1, CV_32FC3, ...)
+    20  int32    reserved
+    24  int64    offset of the first row
+*/
+
+#define RAW_MAGIC "PSRAW01"
+#define RAW_DATA_OFFSET 4096
+
+struct RawHeader {
+  char magic[8];
+  int32_t rows;
+  int32_t cols;
+  int32_t type;
+  int32_t reserved;
+  int64_t offset;
+};
+
+
+//Opens a file of the right size and writes the header, rows are written by the caller
+inline FILE* CreateRawImage(const std::string& file, int rows, int cols, int type) {
+
+  FILE* f = fopen(file.c_str(), "wb");
+  if (!f) {
+    return NULL;
+  }
+
+  char page[RAW_DATA_OFFSET];
+  memset(page, 0, sizeof(page));
+
+  RawHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RAW_MAGIC, sizeof(header.magic));
+  header.rows = rows;
+  header.cols = cols;
+  header.type = type;
+  header.offset = RAW_DATA_OFFSET;
+  memcpy(page, &header, sizeof(header));
+
+  if (fwrite(page, 1, sizeof(page), f) != sizeof(page)) {
+    fclose(f);
+    return NULL;
+  }
+
+  return f;
+}
+
+//Appends I row by row, I has to match the type the file was created with
+inline bool AppendRawRows(FILE* f, const cv::Mat& I) {
+
+  size_t rowSize = I.cols * I.elemSize();
+
+  if (I.isContinuous()) {
+    return fwrite(I.data, 1, rowSize * I.rows, f) == rowSize * I.rows;
+  }
+
+  for (int i = 0; i < I.rows; i++) {
+    if (fwrite(I.ptr(i), 1, rowSize, f) != rowSize) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+inline bool WriteRawImage(const std::string& file, const cv::Mat& I) {
+
+  FILE* f = CreateRawImage(file, I.rows, I.cols, I.type());
+  if (!f) {
+    return false;
+  }
+
+  bool ok = AppendRawRows(f, I);
+  return (fclose(f) == 0) && ok;
+}
+
+//Opens a full size raw image for writing rows in place and seeks to row r0. The first caller
+//creates it, several processes (or nodes on a shared filesystem) can write disjoint rows at once
+inline FILE* OpenRawImageRows(const std::string& file, int rows, int cols, int type, int r0) {
+
+  FILE* f = fopen(file.c_str(), "r+b");
+
+  if (!f) {
+
+    //built under a private name and linked in, whoever links first wins and the rest open that one
+    char host[256] = { 0 };
+    gethostname(host, sizeof(host) - 1);
+    std::string tmp = file + "." + host + "." + std::to_string(getpid());
+
+    FILE* t = CreateRawImage(tmp, rows, cols, type);
+    if (!t) {
+      return NULL;
+    }
+
+    bool ok = ftruncate(fileno(t), RAW_DATA_OFFSET + (off_t)rows*cols*CV_ELEM_SIZE(type)) == 0;
+    ok = (fclose(t) == 0) && ok;
+    ok = ok && (link(tmp.c_str(), file.c_str()) == 0 || errno == EEXIST);
+    unlink(tmp.c_str());
+
+    if (!ok || !(f = fopen(file.c_str(), "r+b"))) {
+      return NULL;
+    }
+  }
+
+  RawHeader header;
+  if (fread(&header, sizeof(header), 1, f) != 1 || strncmp(header.magic, RAW_MAGIC, sizeof(header.magic)) != 0 ||
+      header.rows != rows || header.cols != cols || header.type != type ||
+      fseeko(f, header.offset + (off_t)r0*cols*CV_ELEM_SIZE(type), SEEK_SET) != 0) {
+    fclose(f);
+    return NULL;
+  }
+
+  return f;
+}
+
+
+//Read only mapping of a raw image, the Mat stays valid while this object lives
+class MappedRawImage {
+
+public:
+
+  cv::Mat mat;
+
+  MappedRawImage() : base(NULL), length(0) {}
+  ~MappedRawImage() { close(); }
+
+  bool open(const std::string& file) {
+
+    close();
+
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(RawHeader)) {
+      ::close(fd);
+      return false;
+    }
+
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      return false;
+    }
+
+    base = p;
+    length = st.st_size;
+
+    RawHeader header;
+    memcpy(&header, base, sizeof(header));
+
+    size_t needed = header.offset + (size_t)header.rows * header.cols * CV_ELEM_SIZE(header.type);
+
+    if (strncmp(header.magic, RAW_MAGIC, sizeof(header.magic)) != 0 || needed > length) {
+      close();
+      return false;
+    }
+
+    mat = cv::Mat(header.rows, header.cols, header.type, (char*)base + header.offset);
+    return true;
+  }
+
+  //Drops rows [r0,r1) from the page cache once a strip is done, keeps resident memory bounded
+  void evict(int r0, int r1) {
+
+    if (!base || r1 <= r0) {
+      return;
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t begin = ((char*)mat.data - (char*)base) + (size_t)r0 * mat.step;
+    size_t end = ((char*)mat.data - (char*)base) + (size_t)r1 * mat.step;
+
+    begin = (begin + page - 1) / page * page;
+    end = end / page * page;
+
+    if (end > begin) {
+      madvise((char*)base + begin, end - begin, MADV_DONTNEED);
+    }
+  }
+
+  void close() {
+
+    mat = cv::Mat();
+    if (base) {
+      munmap(base, length);
+    }
+    base = NULL;
+    length = 0;
+  }
+
+private:
+
+  void* base;
+  size_t length;
+
+  MappedRawImage(const MappedRawImage&);
+  MappedRawImage& operator=(const MappedRawImage&);
+};
+
+#endif
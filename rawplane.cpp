@@ -0,0 +1,45 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "rawimage.hpp"
+
+
+using namespace cv;
+using namespace std;
+
+
+//Converts an image into the raw container the --strip modes of normal and albedo map from disk
+//The source is decoded whole (imread has no row bands), only the steps after this one stream
+int main( int argc, char* argv[]) {
+
+  if (argc < 3) {
+      
+    cout << "Not enough parameters" << endl;
+    cout << "How to use: \n" << "'/Path/To/Image' '/Path/To/Output.raw' [G]\n" << "The image is decoded whole, it has to fit in memory once; the --strip modes stream the .raw it writes"; 
+    return -1;
+
+  }
+
+  Mat I;
+  if( argc == 4 && string(argv[3]) == "G" )
+    I = imread(argv[1], IMREAD_GRAYSCALE);
+  else
+    I = imread(argv[1], IMREAD_COLOR);
+
+  if (!I.data) {
+    cout << "The image" << argv[1] << " could not be loaded." << endl;
+    return -1;
+  }
+
+  if (!WriteRawImage(argv[2], I)) {
+    cout << "Could not write " << argv[2] << endl;
+    return -1;
+  }
+ 
+  return 0;
+}
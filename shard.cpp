@@ -0,0 +1,321 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+
+#include <sys/wait.h>
+
+#include <opencv2/core/core.hpp>
+
+#include "queue.hpp"
+#include "rawimage.hpp"
+
+
+using namespace cv;
+using namespace std;
+
+
+/*
+  Sharded runs
+
+  The coordinator turns a dataset into work items in a queue directory (see
+  queue.hpp): one item per folder (normal + albedo), or one item per band
+  of rows of a single huge image in strip mode, all bands writing into the
+  same output file in place. Any number of workers, on this machine or on
+  other nodes that see the queue and the data at the same paths, claim
+  items until the queue is empty. A worker that dies loses its items after
+  the lease and another worker runs them again. Items run normal and albedo
+  from the directory shard itself was started from, by absolute path, with
+  normal kept headless.
+*/
+
+string ToolDirectory(const char* argv0);
+bool AbsolutePath(string path, string& absolute);
+string Quote(string s);
+string JoinOptions(int argc, char* argv[], int first);
+int RunWorker(string queue, int attempts, int lease);
+int PrintStatus(string queue);
+
+
+int main( int argc, char* argv[]) {
+
+  if (argc < 3) {
+
+    cout << "Not enough parameters" << endl;
+    cout << "How to use: \n"
+         << "'/Path/To/Queue' folders 'threshold(int)' 'iterations(int)' '/Path/To/Folder' ... [-- normal options]\n"
+         << "'/Path/To/Queue' bands '/Path/To/Folder' 'threshold(int)' '/Path/To/calibration.txt' 'rows(int)' [-- normal options]\n"
+         << "'/Path/To/Queue' work [--attempts n] [--lease seconds]\n"
+         << "'/Path/To/Queue' status";
+    return -1;
+
+  }
+
+  string queue = argv[1];
+  string command = argv[2];
+
+  if (command == "work") {
+
+    int attempts = QUEUE_ATTEMPTS;
+    int lease = QUEUE_LEASE;
+    for(int k = 3; k < argc; k++) {
+      string arg = argv[k];
+      if(arg == "--attempts" && k+1 < argc) {
+        attempts = stoi(argv[++k]);
+      } else if(arg == "--lease" && k+1 < argc) {
+        lease = stoi(argv[++k]);
+      } else {
+        cout << "Unknown option " << arg << endl;
+        return -1;
+      }
+    }
+
+    //the heartbeat has to land well inside the lease
+    if (lease < 3*QUEUE_HEARTBEAT) {
+      cout << "--lease has to be at least " << 3*QUEUE_HEARTBEAT << " seconds" << endl;
+      return -1;
+    }
+
+    return RunWorker(queue, attempts, lease);
+  }
+
+  if (command == "status") {
+    return PrintStatus(queue);
+  }
+
+  if (!CreateQueue(queue)) {
+    cout << "The queue " << queue << " could not be created." << endl;
+    return -1;
+  }
+
+  int added = 0;
+  string tools = ToolDirectory(argv[0]);
+
+  if (command == "folders" && argc > 5) {
+
+    int threshold = stoi(argv[3]);
+    int iterations = stoi(argv[4]);
+
+    //workers run from their own cwd, items only carry absolute paths, all checked before any is added
+    int k = 5;
+    vector<string> folders;
+    while(k < argc && string(argv[k]) != "--") {
+      string folder;
+      if (!AbsolutePath(argv[k], folder)) {
+        cout << "The folder " << argv[k] << " could not be found." << endl;
+        return -1;
+      }
+      folders.push_back(folder);
+      k++;
+    }
+    string options = JoinOptions(argc, argv, k + 1);
+
+    for(size_t f = 0; f < folders.size(); f++) {
+
+      string folder = folders[f];
+
+      //numbered so items run in the order given, the folder name keeps the logs readable
+      string base = folder.substr(folder.find_last_of('/') + 1);
+      replace(base.begin(), base.end(), '~', '_');
+      char id[16];
+      snprintf(id, sizeof(id), "%05d_", (int)f);
+
+      string line = Quote(tools + "/normal") + " " + Quote(folder) + " " + to_string(threshold) + " " + to_string(iterations) + " --headless" + options +
+                    " && " + Quote(tools + "/albedo") + " " + Quote(folder);
+
+      if (!AddWorkItem(queue, id + base, line)) {
+        cout << "Could not add " << folder << " to " << queue << endl;
+        return -1;
+      }
+      added++;
+    }
+
+  } else if (command == "bands" && argc > 6) {
+
+    string folder, calibFile;
+    int threshold = stoi(argv[4]);
+    if (!AbsolutePath(argv[3], folder) || !AbsolutePath(argv[5], calibFile)) {
+      cout << "The folder " << argv[3] << " or the calibration " << argv[5] << " could not be found." << endl;
+      return -1;
+    }
+    int rows = stoi(argv[6]);
+    string options = JoinOptions(argc, argv, (argc > 7 && string(argv[7]) == "--") ? 8 : argc);
+
+    //all bands share one calibration, searching per band would give seams
+    ifstream calib(calibFile);
+    if (!calib.is_open()) {
+      cout << "The calibration " << calibFile << " could not be loaded." << endl;
+      return -1;
+    }
+
+    MappedRawImage plane;
+    string file = folder + "/final_1.raw";
+    if (!plane.open(file)) {
+      cout << "The image " << file << " could not be mapped." << endl;
+      return -1;
+    }
+
+    if (rows <= 0) {
+      cout << "rows has to be positive" << endl;
+      return -1;
+    }
+
+    if (options.find("--strip") == string::npos) {
+      options += " --strip " + to_string(min(rows, 512));
+    }
+
+    for(int r0 = 0; r0 < plane.mat.rows; r0 += rows) {
+
+      int r1 = min(r0 + rows, plane.mat.rows);
+      char id[32];
+      snprintf(id, sizeof(id), "band_%09d", r0);
+
+      string line = Quote(tools + "/normal") + " " + Quote(folder) + " " + to_string(threshold) + " 0 --headless --calib " + Quote(calibFile) +
+                    " --band " + to_string(r0) + "," + to_string(r1) + options;
+
+      if (!AddWorkItem(queue, id, line)) {
+        cout << "Could not add rows " << r0 << " to " << r1 << " to " << queue << endl;
+        return -1;
+      }
+      added++;
+    }
+
+  } else {
+
+    cout << "Unknown command " << command << endl;
+    return -1;
+
+  }
+
+  cout << added << " items added to " << queue << endl;
+  return 0;
+}
+
+
+//Claims and runs items until pending and running are both empty
+int RunWorker(string queue, int attempts, int lease) {
+
+  char host[256] = { 0 };
+  gethostname(host, sizeof(host) - 1);
+  string worker = string(host) + "~" + to_string(getpid());
+
+  int done = 0, failed = 0;
+
+  while(1) {
+
+    RequeueStale(queue, lease, attempts);
+
+    WorkItem item;
+    if (!ClaimWorkItem(queue, worker, item)) {
+
+      //items still running elsewhere can come back if that worker dies
+      if (ListQueue(queue + "/pending").empty() && ListQueue(queue + "/running").empty()) {
+        break;
+      }
+      this_thread::sleep_for(chrono::seconds(1));
+      continue;
+    }
+
+    cout << "Running " << item.id << " (attempt " << item.attempt + 1 << ")" << endl;
+
+    string line = "(" + item.command + ") >> " + Quote(queue + "/logs/" + item.id) + " 2>&1";
+
+    atomic<bool> finished(false);
+    int status = -1;
+    thread run([&]() {
+      status = system(line.c_str());
+      finished = true;
+    });
+
+    //keeps the lease while the command runs
+    bool held = true;
+    int waited = 0;
+    while(!finished) {
+      this_thread::sleep_for(chrono::milliseconds(100));
+      if (++waited % (QUEUE_HEARTBEAT*10) == 0 && held) {
+        held = TouchWorkItem(queue, item);
+      }
+    }
+    run.join();
+
+    bool ok = status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    //a lost lease means the item was handed out again, the other worker reports it
+    if (ok && CompleteWorkItem(queue, item)) {
+      done++;
+    } else if (!ok && RetryWorkItem(queue, item.running, item.id, item.attempt, attempts)) {
+      cout << item.id << " failed, see " << queue << "/logs/" << item.id << endl;
+      failed++;
+    }
+  }
+
+  cout << done << " items done, " << failed << " attempts failed" << endl;
+  return 0;
+}
+
+int PrintStatus(string queue) {
+
+  const char* states[] = { "pending", "running", "done", "failed" };
+  for(int k = 0; k < 4; k++) {
+    cout << states[k] << " " << ListQueue(queue + "/" + states[k]).size() << endl;
+  }
+
+  vector<string> failed = ListQueue(queue + "/failed");
+  for(size_t k = 0; k < failed.size(); k++) {
+    cout << "failed: " << failed[k] << " (" << queue << "/logs/" << failed[k] << ")" << endl;
+  }
+
+  return failed.empty() ? 0 : 1;
+}
+
+//absolute directory of this binary, found through argv[0] or /proc/self/exe when it came from PATH
+string ToolDirectory(const char* argv0) {
+
+  char path[PATH_MAX];
+  string self;
+
+  if (strchr(argv0, '/') && realpath(argv0, path)) {
+    self = path;
+  } else {
+    ssize_t n = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    self = n > 0 ? string(path, n) : string("./shard");
+  }
+
+  return self.substr(0, self.find_last_of('/'));
+}
+
+//realpath, false when the path does not resolve
+bool AbsolutePath(string path, string& absolute) {
+
+  char resolved[PATH_MAX];
+  if (!realpath(path.c_str(), resolved)) {
+    return false;
+  }
+  absolute = resolved;
+  return true;
+}
+
+//single quoted for /bin/sh
+string Quote(string s) {
+
+  string q = "'";
+  for(size_t k = 0; k < s.size(); k++) {
+    q += s[k] == '\'' ? string("'\\''") : string(1, s[k]);
+  }
+  return q + "'";
+}
+
+string JoinOptions(int argc, char* argv[], int first) {
+
+  string options;
+  for(int k = first; k < argc; k++) {
+    options += " " + Quote(argv[k]);
+  }
+  return options;
+}
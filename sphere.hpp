@@ -0,0 +1,92 @@
+#ifndef SPHERE_HPP
+#define SPHERE_HPP
+
+#include <cmath>
+#include <cstdlib>
+
+#include <opencv2/core/core.hpp>
+
+
+//Center of mass (row, column) and radius of the white (255) disc of a binarized sphere image
+//Returns false when there is no white pixel
+inline bool FindSphere(const cv::Mat& I, int params[3]) {
+
+  int nRows = I.rows;
+  int nCols = I.cols;
+
+  long area = 0;
+  long i_sum = 0, j_sum = 0;
+  int top = nRows;
+  int bot = 0;
+  int left = nCols;
+  int right = 0;
+
+  for(int i = 0; i < nRows; ++i) {
+    const unsigned char* p = I.ptr<unsigned char>(i);
+    for(int j = 0; j < nCols; ++j) {
+      if(p[j] == 255) {
+        if(i < top) top = i;
+        if(i > bot) bot = i;
+        if(j < left) left = j;
+        if(j > right) right = j;
+        area ++;
+        i_sum += i;
+        j_sum += j;
+      }
+    }
+  }
+
+  if(area == 0) {
+    return false;
+  }
+
+  //compute radius
+  params[0] = (int)(i_sum/area);
+  params[1] = (int)(j_sum/area);
+  params[2] = std::abs((((bot-top)+(right-left))/2)/2);
+
+  return true;
+}
+
+//Light direction for the grayscale image I of the sphere found by FindSphere, taken from
+//where its highlight sits on the sphere and scaled by the highlight's intensity
+inline void SphereLight(const cv::Mat& I, const int params[3], double n[3]) {
+
+  int i_coord = params[0];
+  int j_coord = params[1];
+  int radius = params[2];
+
+  int max = 0, i_max = 0, j_max = 0;
+
+  for(int i = 0; i < I.rows; ++i) {
+    const unsigned char* p = I.ptr<unsigned char>(i);
+    for(int j = 0; j < I.cols; ++j) {
+      if(p[j] > max) {
+        max = p[j];
+        i_max = i;
+        j_max = j;
+      }
+    }
+  }
+
+  double normal[3];
+  normal[0] = i_max-i_coord;
+  normal[1] = j_max-j_coord;
+
+  //compute Z of normal vector using (Z^2 = R^2-X^2-Y^2)
+  int result = pow(radius,2)-pow(normal[0],2)-pow(normal[1],2);
+  if(result < 0) {
+    normal[2] = -sqrt(-result);
+  } else {
+    normal[2] = sqrt(result);
+  }
+
+  double mag = sqrt(pow(normal[0],2)+pow(normal[1],2)+pow(normal[2],2));
+
+  //normalized vector scaled by the intensity of the pixel
+  for(int k = 0; k < 3; k++) {
+    n[k] = mag > 0 ? (normal[k]/mag)*max : 0;
+  }
+}
+
+#endif
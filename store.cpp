@@ -0,0 +1,134 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <iterator>
+
+#include <opencv2/core/core.hpp>
+
+#include "rawimage.hpp"
+#include "store.hpp"
+
+
+using namespace cv;
+using namespace std;
+
+bool ReadFile(string file, vector<unsigned char>& data);
+
+
+//Adds files to a store, lists it or copies an entry back out
+int main( int argc, char* argv[]) {
+
+  if (argc < 3) {
+
+    cout << "Not enough parameters" << endl;
+    cout << "How to use: \n" << "'/Path/To/Store' list\n" << "'/Path/To/Store' add [--root '/Path/To/Folder'] 'file' ['file' ...]\n" << "'/Path/To/Store' extract 'name' '/Path/To/Output'";
+    return -1;
+
+  }
+
+  string command = argv[2];
+
+  if (command == "add") {
+
+    //names are relative to the root, the store's folder unless --root is given
+    int first = 3;
+    string root;
+    if (argc > 4 && string(argv[3]) == "--root") {
+      root = argv[4];
+      first = 5;
+    }
+
+    OutputStore store;
+    if (!store.open(argv[1], root)) {
+      cout << "The store " << argv[1] << " could not be opened." << endl;
+      return -1;
+    }
+
+    for(int k = first; k < argc; k++) {
+
+      //raw containers go in as image entries so they stay mappable, everything else as bytes
+      MappedRawImage raw;
+      vector<unsigned char> data;
+      string name;
+      bool ok = store.name(argv[k], name);
+
+      if (ok && raw.open(argv[k])) {
+        ok = store.addImage(name, raw.mat);
+      } else if (ok) {
+        ok = ReadFile(argv[k], data) && store.addBlob(name, data.data(), data.size());
+      }
+
+      if (!ok) {
+        cout << "Could not add " << argv[k] << endl;
+        return -1;
+      }
+    }
+
+    if (!store.close()) {
+      cout << "Could not write the index of " << argv[1] << endl;
+      return -1;
+    }
+
+    return 0;
+  }
+
+  MappedStore store;
+  if (!store.open(argv[1])) {
+    cout << "The store " << argv[1] << " could not be opened." << endl;
+    return -1;
+  }
+
+  if (command == "list") {
+
+    for(size_t k = 0; k < store.entries.size(); k++) {
+      const StoreEntry& e = store.entries[k];
+      cout << e.name << "\t" << e.length << " bytes";
+      if (e.kind == STORE_IMAGE) {
+        cout << "\t" << e.cols << "x" << e.rows << " type " << e.type;
+      }
+      cout << endl;
+    }
+
+    return 0;
+  }
+
+  if (command == "extract" && argc > 4) {
+
+    Mat I;
+    const unsigned char* data;
+    size_t size;
+    bool ok;
+
+    if (store.image(argv[3], I)) {
+      ok = WriteRawImage(argv[4], I);
+    } else if (store.blob(argv[3], data, size)) {
+      ofstream out(argv[4], ios::binary);
+      out.write((const char*)data, size);
+      ok = out.good();
+    } else {
+      cout << "No entry " << argv[3] << " in " << argv[1] << endl;
+      return -1;
+    }
+
+    if (!ok) {
+      cout << "Could not write " << argv[4] << endl;
+      return -1;
+    }
+
+    return 0;
+  }
+
+  cout << "Unknown command " << command << endl;
+  return -1;
+}
+
+bool ReadFile(string file, vector<unsigned char>& data) {
+
+  ifstream in(file, ios::binary);
+  if (!in.is_open()) {
+    return false;
+  }
+
+  data.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+  return !in.bad();
+}
@@ -0,0 +1,472 @@
+#ifndef STORE_HPP
+#define STORE_HPP
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include "rawimage.hpp"
+
+
+/*
+  Output store
+
+  One append-only file for everything a run produces. Entries are either
+  raw images (rows of pixels on a page boundary, mapped straight into a
+  cv::Mat like the raw container) or blobs (encoded jpg/png/exr bytes,
+  calibration.txt, run parameters). Every entry is committed on its own:
+  an index of all entries so far and a fixed trailer are appended after
+  it, then the end of that trailer is written into the header:
+
+    0    char[8]  magic "PSSTORE1"
+    8    int64    committed size, end of the last complete trailer (0 in
+                  stores written before it was kept, the file end is used)
+    ...  rest of the first page is reserved
+    ...  entries, each on a page boundary, each followed by
+         index, StoreEntry per entry
+         trailer: char[8] "PSINDEX1", int64 index offset, int64 count, int64 reserved
+
+  Earlier indexes are never touched. A name added again replaces the old
+  entry in the next index. Readers go by the committed size, so they see
+  every committed entry while a writer is still appending. A writer that
+  dies mid entry leaves bytes past the committed size, the next writer cuts
+  them off when it opens the store.
+
+  Entries are named by the path of the file they would have been written
+  to, relative to a root given to the writer (the store's own folder by
+  default): a/scan1/normal_10_500.jpg and b/scan1/normal_10_500.jpg stay two
+  entries. Files outside the root and names longer than a StoreEntry holds
+  are refused, not cut.
+
+  A writer holds an exclusive flock on the store from open to close, other
+  writers (other processes, or shard workers on other nodes over NFS) wait
+  in open until it is done. Keep the session short: open the store when the
+  products are ready, not before the work that makes them.
+*/
+
+#define STORE_MAGIC "PSSTORE1"
+#define STORE_INDEX_MAGIC "PSINDEX1"
+
+#define STORE_IMAGE 0
+#define STORE_BLOB 1
+
+struct StoreEntry {
+  char name[112];
+  int32_t kind;
+  int32_t type;
+  int32_t rows;
+  int32_t cols;
+  int64_t offset;
+  int64_t length;
+};
+
+struct StoreTrailer {
+  char magic[8];
+  int64_t index;
+  int64_t count;
+  int64_t reserved;
+};
+
+
+//Reads the index of an open store up to its committed size (end), false when no valid trailer ends there
+inline bool ReadStoreIndex(FILE* f, std::vector<StoreEntry>& entries, int64_t& end) {
+
+  StoreTrailer trailer;
+
+  end = 0;
+  if (fseeko(f, 8, SEEK_SET) != 0 || fread(&end, sizeof(end), 1, f) != 1) {
+    return false;
+  }
+  if (end <= 0) {
+    if (fseeko(f, 0, SEEK_END) != 0) {
+      return false;
+    }
+    end = ftello(f);
+  }
+
+  if (end < (int64_t)sizeof(trailer) || fseeko(f, end - (off_t)sizeof(trailer), SEEK_SET) != 0 || fread(&trailer, sizeof(trailer), 1, f) != 1 ||
+      strncmp(trailer.magic, STORE_INDEX_MAGIC, sizeof(trailer.magic)) != 0 || trailer.count < 0) {
+    return false;
+  }
+
+  entries.resize(trailer.count);
+
+  return fseeko(f, trailer.index, SEEK_SET) == 0 &&
+         (trailer.count == 0 || fread(entries.data(), sizeof(StoreEntry), trailer.count, f) == (size_t)trailer.count);
+}
+
+
+//Appends entries to a store, safe to use from several threads
+class OutputStore {
+
+public:
+
+  OutputStore() : f(NULL) {}
+  ~OutputStore() { close(); }
+
+  //Creates the store or reopens it for appending, blocks while another writer has it open
+  //and drops whatever a writer that died left after the last committed entry
+  //Files are named relative to root, the folder the store is in when none is given
+  bool open(const std::string& file, const std::string& root = "") {
+
+    close();
+
+    char* r = realpath((root.empty() ? StoreFolder(file) : root).c_str(), NULL);
+    if (!r) {
+      return false;
+    }
+    base = r;
+    free(r);
+
+    //created and locked before anything is read, two first writers can not both write a header
+    int fd = ::open(file.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+      return false;
+    }
+
+    struct stat st;
+    if (flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0 || !(f = fdopen(fd, "r+b"))) {
+      ::close(fd);
+      return false;
+    }
+
+    if (st.st_size > 0) {
+
+      char magic[8];
+      int64_t end;
+      if (fread(magic, sizeof(magic), 1, f) != 1 || strncmp(magic, STORE_MAGIC, sizeof(magic)) != 0 || !ReadStoreIndex(f, entries, end) ||
+          (st.st_size > end && ftruncate(fd, end) != 0) || fseeko(f, end, SEEK_SET) != 0) {
+        fclose(f);
+        f = NULL;
+        return false;
+      }
+
+      return true;
+    }
+
+    //a new store is readable (empty) straight away
+    char page[RAW_DATA_OFFSET];
+    memset(page, 0, sizeof(page));
+    memcpy(page, STORE_MAGIC, 8);
+
+    entries.clear();
+    if (fwrite(page, sizeof(page), 1, f) != 1 || !commit()) {
+      fclose(f);
+      f = NULL;
+      return false;
+    }
+
+    return true;
+  }
+
+  //Pixel rows, written without row padding so readers can map them
+  bool addImage(const std::string& name, const cv::Mat& I) {
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    StoreEntry e;
+    if (!f || !entry(name, STORE_IMAGE, I.type(), I.rows, I.cols, e) || !begin(e)) {
+      return false;
+    }
+
+    size_t row = I.cols*I.elemSize();
+    for(int i = 0; i < I.rows; i++) {
+      if (fwrite(I.ptr(i), 1, row, f) != row) {
+        return false;
+      }
+    }
+
+    e.length = (int64_t)row*I.rows;
+    entries.push_back(e);
+    return commit();
+  }
+
+  bool addBlob(const std::string& name, const void* data, size_t length) {
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    StoreEntry e;
+    if (!f || !entry(name, STORE_BLOB, 0, 0, 0, e) || !begin(e) || (length > 0 && fwrite(data, 1, length, f) != length)) {
+      return false;
+    }
+
+    e.length = length;
+    entries.push_back(e);
+    return commit();
+  }
+
+  bool addText(const std::string& name, const std::string& text) {
+    return addBlob(name, text.data(), text.size());
+  }
+
+  //Entry name of a file, its path relative to the root, false when it is outside the root
+  bool name(const std::string& file, std::string& entry) const {
+
+    size_t slash = file.find_last_of('/');
+    std::string leaf = file.substr(slash == std::string::npos ? 0 : slash + 1);
+
+    char* r = realpath(StoreFolder(file).c_str(), NULL);
+    std::string folder = r ? r : "";
+    free(r);
+
+    std::string prefix = base == "/" ? base : base + "/";
+    if (folder == base) {
+      entry = leaf;
+    } else if (!folder.empty() && folder.compare(0, prefix.size(), prefix) == 0) {
+      entry = folder.substr(prefix.size()) + "/" + leaf;
+    } else {
+      std::cout << file << " is not under the store root " << base << std::endl;
+      return false;
+    }
+
+    return true;
+  }
+
+  //Releases the lock, every entry added is already committed
+  bool close() {
+
+    if (!f) {
+      return true;
+    }
+
+    bool ok = fclose(f) == 0;
+    f = NULL;
+    entries.clear();
+    return ok;
+  }
+
+private:
+
+  FILE* f;
+  std::string base;
+  std::vector<StoreEntry> entries;
+  std::mutex mutex;
+
+  //folder part of a path, "." for a bare file name
+  static std::string StoreFolder(const std::string& file) {
+
+    size_t slash = file.find_last_of('/');
+    if (slash == std::string::npos) {
+      return ".";
+    }
+    return slash == 0 ? "/" : file.substr(0, slash);
+  }
+
+  //index and trailer after the last entry, then their end into the header
+  bool commit() {
+
+    //newest entry of each name wins
+    std::vector<StoreEntry> index;
+    for(size_t k = 0; k < entries.size(); k++) {
+      bool replaced = false;
+      for(size_t n = k + 1; n < entries.size() && !replaced; n++) {
+        replaced = strncmp(entries[k].name, entries[n].name, sizeof(entries[k].name)) == 0;
+      }
+      if (!replaced) {
+        index.push_back(entries[k]);
+      }
+    }
+
+    StoreTrailer trailer;
+    memset(&trailer, 0, sizeof(trailer));
+    memcpy(trailer.magic, STORE_INDEX_MAGIC, sizeof(trailer.magic));
+    trailer.index = ftello(f);
+    trailer.count = index.size();
+
+    if (!(index.empty() || fwrite(index.data(), sizeof(StoreEntry), index.size(), f) == index.size()) ||
+        fwrite(&trailer, sizeof(trailer), 1, f) != 1 || fflush(f) != 0) {
+      return false;
+    }
+
+    //the entry only counts once everything before the new end is on disk
+    int64_t end = ftello(f);
+    return fdatasync(fileno(f)) == 0 && fseeko(f, 8, SEEK_SET) == 0 && fwrite(&end, sizeof(end), 1, f) == 1 &&
+           fflush(f) == 0 && fseeko(f, end, SEEK_SET) == 0;
+  }
+
+  //false for a name that does not fit, a cut name could replace another entry
+  bool entry(const std::string& name, int kind, int type, int rows, int cols, StoreEntry& e) {
+
+    memset(&e, 0, sizeof(e));
+    if (name.empty() || name.size() >= sizeof(e.name)) {
+      std::cout << "Store entry name " << name << " is not 1 to " << sizeof(e.name) - 1 << " characters" << std::endl;
+      return false;
+    }
+
+    memcpy(e.name, name.c_str(), name.size());
+    e.kind = kind;
+    e.type = type;
+    e.rows = rows;
+    e.cols = cols;
+    return true;
+  }
+
+  //pads to the next page, every entry starts mappable
+  bool begin(StoreEntry& e) {
+
+    off_t at = ftello(f);
+    off_t start = (at + RAW_DATA_OFFSET - 1)/RAW_DATA_OFFSET*RAW_DATA_OFFSET;
+
+    static const char zero[RAW_DATA_OFFSET] = { 0 };
+    if (start > at && fwrite(zero, 1, start - at, f) != (size_t)(start - at)) {
+      return false;
+    }
+
+    e.offset = start;
+    return true;
+  }
+
+  OutputStore(const OutputStore&);
+  OutputStore& operator=(const OutputStore&);
+};
+
+
+//Read only mapping of a store, images and blobs point into the mapping while this object lives
+class MappedStore {
+
+public:
+
+  std::vector<StoreEntry> entries;
+
+  MappedStore() : base(NULL), length(0) {}
+  ~MappedStore() { close(); }
+
+  bool open(const std::string& file) {
+
+    close();
+
+    FILE* f = fopen(file.c_str(), "rb");
+    if (!f) {
+      return false;
+    }
+
+    char magic[8];
+    int64_t end;
+    bool ok = fread(magic, sizeof(magic), 1, f) == 1 && strncmp(magic, STORE_MAGIC, sizeof(magic)) == 0 && ReadStoreIndex(f, entries, end);
+    fclose(f);
+
+    if (!ok) {
+      return false;
+    }
+
+    int fd = ::open(file.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      if (fd >= 0) ::close(fd);
+      return false;
+    }
+
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      return false;
+    }
+
+    base = p;
+    length = st.st_size;
+
+    for(size_t k = 0; k < entries.size(); k++) {
+      if (entries[k].offset < 0 || entries[k].length < 0 || (size_t)(entries[k].offset + entries[k].length) > length) {
+        close();
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  const StoreEntry* find(const std::string& name) const {
+
+    for(size_t k = 0; k < entries.size(); k++) {
+      if (strncmp(entries[k].name, name.c_str(), sizeof(entries[k].name)) == 0) {
+        return &entries[k];
+      }
+    }
+    return NULL;
+  }
+
+  //Mat over the mapped pixels, no copy
+  bool image(const std::string& name, cv::Mat& I) const {
+
+    const StoreEntry* e = find(name);
+    if (!e || e->kind != STORE_IMAGE) {
+      return false;
+    }
+
+    I = cv::Mat(e->rows, e->cols, e->type, (char*)base + e->offset);
+    return true;
+  }
+
+  bool blob(const std::string& name, const unsigned char*& data, size_t& size) const {
+
+    const StoreEntry* e = find(name);
+    if (!e || e->kind != STORE_BLOB) {
+      return false;
+    }
+
+    data = (const unsigned char*)base + e->offset;
+    size = e->length;
+    return true;
+  }
+
+  void close() {
+
+    if (base) {
+      munmap(base, length);
+    }
+    base = NULL;
+    length = 0;
+    entries.clear();
+  }
+
+private:
+
+  void* base;
+  size_t length;
+
+  MappedStore(const MappedStore&);
+  MappedStore& operator=(const MappedStore&);
+};
+
+
+//imwrite, or the encoded bytes into the store when there is one
+inline bool StoreImage(OutputStore* store, const std::string& file, const cv::Mat& I, const std::vector<int>& params = std::vector<int>()) {
+
+  if (!store) {
+    return cv::imwrite(file, I, params);
+  }
+
+  std::string name;
+  std::vector<unsigned char> buf;
+  return store->name(file, name) && cv::imencode(file.substr(file.find_last_of('.')), I, buf, params) && store->addBlob(name, buf.data(), buf.size());
+}
+
+//WriteRawImage, or the pixels as a mappable image entry
+inline bool StoreRawImage(OutputStore* store, const std::string& file, const cv::Mat& I) {
+
+  std::string name;
+  return store ? store->name(file, name) && store->addImage(name, I) : WriteRawImage(file, I);
+}
+
+//text that would have been written to file, as a blob entry
+inline bool StoreText(OutputStore& store, const std::string& file, const std::string& text) {
+
+  std::string name;
+  return store.name(file, name) && store.addText(name, text);
+}
+
+#endif
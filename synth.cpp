@@ -0,0 +1,236 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <cstdlib>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "rawimage.hpp"
+
+
+using namespace cv;
+using namespace std;
+
+
+/*
+  Synthetic scenes
+
+  Renders Lambertian light sets with known answers: final_1..N.jpg like a
+  real scan, the true normals in normal_gt.raw (float x,y,z, x right, y up,
+  z towards the camera) and the true light directions in lights.txt (one
+  unit x y z per line). Rows are generated a strip at a time, so the
+  normals of 100MP scenes never have to be held in memory.
+*/
+
+struct Bump {
+  double x, y, sigma, height;
+};
+
+#define SYNTH_STRIP 256
+
+void SceneNormal(bool sphere, const vector<Bump>& bumps, int rows, int cols, int r, int c, float* n);
+double SceneAlbedo(bool texture, int rows, int cols, int r, int c);
+
+
+int main( int argc, char* argv[]) {
+
+  if (argc < 6) {
+
+    cout << "Not enough parameters" << endl;
+    cout << "How to use: \n" << "'/Path/To/Output' 'sphere|heightfield' 'width(int)' 'height(int)' 'lights(int)' [--texture] [--elevation degrees] [--seed n]";
+    return -1;
+
+  }
+
+  string folder = argv[1];
+  string scene = argv[2];
+  int cols = stoi(argv[3]);
+  int rows = stoi(argv[4]);
+  int lights = stoi(argv[5]);
+  bool texture = false;
+  double elevation = 45;
+  int seed = 1;
+
+  for(int k = 6; k < argc; k++) {
+    string arg = argv[k];
+    if(arg == "--texture") {
+      texture = true;
+    } else if(arg == "--elevation" && k+1 < argc) {
+      elevation = stod(argv[++k]);
+    } else if(arg == "--seed" && k+1 < argc) {
+      seed = stoi(argv[++k]);
+    } else {
+      cout << "Unknown option " << arg << endl;
+      return -1;
+    }
+  }
+
+  if (scene != "sphere" && scene != "heightfield") {
+    cout << "Unknown scene " << scene << endl;
+    return -1;
+  }
+
+  if (lights < 3 || cols <= 0 || rows <= 0) {
+    cout << "Needs at least 3 lights and a positive size" << endl;
+    return -1;
+  }
+
+  //lights evenly around the subject at the same elevation
+  vector<Vec3d> L(lights);
+  double el = elevation*CV_PI/180;
+  ofstream out(folder + "/lights.txt");
+  for(int k = 0; k < lights; k++) {
+    double az = 2*CV_PI*k/lights + CV_PI/4;
+    L[k] = Vec3d(cos(el)*cos(az), cos(el)*sin(az), sin(el));
+    out << L[k][0] << " " << L[k][1] << " " << L[k][2] << "\n";
+  }
+  out.close();
+
+  //a few gaussian hills and dips, sized relative to the image so any resolution looks alike
+  srand(seed);
+  vector<Bump> bumps;
+  double size = min(rows, cols);
+  for(int k = 0; k < 24; k++) {
+    Bump b;
+    b.x = cols*(rand()/(double)RAND_MAX);
+    b.y = rows*(rand()/(double)RAND_MAX);
+    b.sigma = size*(0.03 + 0.12*rand()/(double)RAND_MAX);
+    b.height = b.sigma*(rand() % 2 ? 1 : -1)*(0.3 + 0.7*rand()/(double)RAND_MAX);
+    bumps.push_back(b);
+  }
+
+  vector<Mat> I(lights);
+  for(int k = 0; k < lights; k++) {
+    I[k].create(rows, cols, CV_8UC1);
+  }
+
+  string gtFile = folder + "/normal_gt.raw";
+  FILE* gt = CreateRawImage(gtFile, rows, cols, CV_32FC3);
+  if (!gt) {
+    cout << "Could not write " << gtFile << endl;
+    return -1;
+  }
+
+  double t = (double)getTickCount();
+
+  Mat N(SYNTH_STRIP, cols, CV_32FC3);
+  bool sphere = scene == "sphere";
+
+  for(int r0 = 0; r0 < rows; r0 += SYNTH_STRIP) {
+
+    int r1 = min(r0 + SYNTH_STRIP, rows);
+
+    parallel_for_(Range(r0, r1), [&](const Range& range) {
+
+      for(int i = range.start; i < range.end; ++i) {
+
+        float* n = N.ptr<float>(i - r0);
+
+        for(int j = 0; j < cols; ++j) {
+
+          SceneNormal(sphere, bumps, rows, cols, i, j, &n[j*3]);
+          double a = SceneAlbedo(texture, rows, cols, i, j);
+
+          for(int k = 0; k < lights; k++) {
+            double d = L[k][0]*n[j*3] + L[k][1]*n[j*3 +1] + L[k][2]*n[j*3 +2];
+            I[k].ptr<uchar>(i)[j] = saturate_cast<uchar>(255*a*max(d, 0.0));
+          }
+        }
+      }
+
+    });
+
+    if (!AppendRawRows(gt, N.rowRange(0, r1 - r0))) {
+      fclose(gt);
+      cout << "Could not write " << gtFile << endl;
+      return -1;
+    }
+
+  }
+
+  fclose(gt);
+
+  vector<int> written(lights, 0);
+  parallel_for_(Range(0, lights), [&](const Range& range) {
+    for(int k = range.start; k < range.end; k++) {
+      written[k] = imwrite(folder + "/final_" + to_string(k+1) + ".jpg", I[k], vector<int>{ IMWRITE_JPEG_QUALITY, 95 });
+    }
+  });
+
+  for(int k = 0; k < lights; k++) {
+    if (!written[k]) {
+      cout << "Could not write the images to " << folder << endl;
+      return -1;
+    }
+  }
+
+  t = ((double)getTickCount() - t)/getTickFrequency();
+  cout << scene << " " << cols << "x" << rows << ", " << lights << " lights: " << t << " s" << endl;
+
+  return 0;
+}
+
+
+//Unit normal at row r, column c, n = (x, y, z) with y up
+void SceneNormal(bool sphere, const vector<Bump>& bumps, int rows, int cols, int r, int c, float* n) {
+
+  double x, y, z;
+
+  if (sphere) {
+
+    //one sphere filling most of the frame on a flat background facing the camera
+    double R = 0.45*min(rows, cols);
+    x = (c + 0.5 - cols/2.0)/R;
+    y = -(r + 0.5 - rows/2.0)/R;
+    double d = x*x + y*y;
+
+    if (d >= 1) {
+      x = 0;
+      y = 0;
+      z = 1;
+    } else {
+      z = sqrt(1 - d);
+    }
+
+  } else {
+
+    //h = sum of gaussians, n = (-dh/dcolumn, dh/drow, 1) normalised
+    double hc = 0, hr = 0;
+    for(size_t k = 0; k < bumps.size(); k++) {
+      double dx = c + 0.5 - bumps[k].x;
+      double dy = r + 0.5 - bumps[k].y;
+      double s2 = bumps[k].sigma*bumps[k].sigma;
+      double g = bumps[k].height*exp(-(dx*dx + dy*dy)/(2*s2));
+      hc -= g*dx/s2;
+      hr -= g*dy/s2;
+    }
+
+    double m = sqrt(hc*hc + hr*hr + 1);
+    x = -hc/m;
+    y = hr/m;
+    z = 1/m;
+
+  }
+
+  n[0] = (float)x;
+  n[1] = (float)y;
+  n[2] = (float)z;
+}
+
+//Smooth printed pattern in [0.35, 1], or a constant 0.9
+double SceneAlbedo(bool texture, int rows, int cols, int r, int c) {
+
+  if (!texture) {
+    return 0.9;
+  }
+
+  double size = min(rows, cols);
+  double u = 2*CV_PI*c/(size/7);
+  double v = 2*CV_PI*r/(size/5);
+
+  return 0.675 + 0.325*sin(u)*cos(v + 0.5*sin(u/3));
+}
@@ -0,0 +1,359 @@
+#ifndef TEXTURE_HPP
+#define TEXTURE_HPP
+
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "tiles.hpp"
+
+
+/*
+  Compressed GPU textures
+
+  Block compression of the maps straight into KTX2 files three.js'
+  KTX2Loader (and any Vulkan/WebGPU loader) uploads as is, full mip chain
+  included:
+
+    BC5  normal maps, x in red and y in green, z is rebuilt in the shader
+    BC4  height maps
+    BC1  albedo (sRGB)
+
+  Every 4x4 block is encoded on its own, block rows run in parallel.
+*/
+
+//Vulkan formats and Khronos data format colour models (khr_df.h) used in the headers
+#define VK_FORMAT_BC1_RGB_SRGB_BLOCK 132
+#define VK_FORMAT_BC4_UNORM_BLOCK 139
+#define VK_FORMAT_BC5_UNORM_BLOCK 141
+
+#define KHR_DF_MODEL_BC1A 128
+#define KHR_DF_MODEL_BC4 131
+#define KHR_DF_MODEL_BC5 132
+
+
+//One BC4 block (8 bytes) from 16 values, 8 value mode with the block's min and max as endpoints
+inline void EncodeBC4Block(const unsigned char* v, unsigned char* out) {
+
+  int hi = v[0], lo = v[0];
+  for(int k = 1; k < 16; k++) {
+    hi = std::max(hi, (int)v[k]);
+    lo = std::min(lo, (int)v[k]);
+  }
+
+  out[0] = (unsigned char)hi;
+  out[1] = (unsigned char)lo;
+
+  uint64_t bits = 0;
+
+  if(hi > lo) {
+    for(int k = 0; k < 16; k++) {
+      //step 0 is hi, step 7 is lo, palette index 0 = hi, 1 = lo, 2..7 = the steps between
+      int step = ((hi - v[k])*7 + (hi - lo)/2)/(hi - lo);
+      int index = step == 0 ? 0 : (step == 7 ? 1 : step + 1);
+      bits |= (uint64_t)index << (3*k);
+    }
+  }
+
+  for(int k = 0; k < 6; k++) {
+    out[2 + k] = (unsigned char)(bits >> (8*k));
+  }
+}
+
+inline int PackRGB565(const double* c) {
+
+  int r = std::min(31, std::max(0, (int)(c[0]*31/255 + 0.5)));
+  int g = std::min(63, std::max(0, (int)(c[1]*63/255 + 0.5)));
+  int b = std::min(31, std::max(0, (int)(c[2]*31/255 + 0.5)));
+  return (r << 11) | (g << 5) | b;
+}
+
+inline void UnpackRGB565(int c, int* rgb) {
+
+  int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+  rgb[0] = (r << 3) | (r >> 2);
+  rgb[1] = (g << 2) | (g >> 4);
+  rgb[2] = (b << 3) | (b >> 2);
+}
+
+//One BC1 block (8 bytes) from 16 RGB pixels, endpoints at the ends of the principal axis
+inline void EncodeBC1Block(const unsigned char* rgb, unsigned char* out) {
+
+  double mean[3] = { 0, 0, 0 };
+  for(int k = 0; k < 16; k++) {
+    for(int c = 0; c < 3; c++) mean[c] += rgb[k*3 + c];
+  }
+  for(int c = 0; c < 3; c++) mean[c] /= 16;
+
+  double cov[6] = { 0, 0, 0, 0, 0, 0 };
+  for(int k = 0; k < 16; k++) {
+    double r = rgb[k*3] - mean[0], g = rgb[k*3 +1] - mean[1], b = rgb[k*3 +2] - mean[2];
+    cov[0] += r*r; cov[1] += r*g; cov[2] += r*b;
+    cov[3] += g*g; cov[4] += g*b; cov[5] += b*b;
+  }
+
+  //a few power iterations are plenty for a 3x3
+  double axis[3] = { 1, 1, 1 };
+  for(int it = 0; it < 4; it++) {
+    double x = cov[0]*axis[0] + cov[1]*axis[1] + cov[2]*axis[2];
+    double y = cov[1]*axis[0] + cov[3]*axis[1] + cov[4]*axis[2];
+    double z = cov[2]*axis[0] + cov[4]*axis[1] + cov[5]*axis[2];
+    double m = std::max(std::fabs(x), std::max(std::fabs(y), std::fabs(z)));
+    if(m == 0) break;
+    axis[0] = x/m; axis[1] = y/m; axis[2] = z/m;
+  }
+
+  double lo = 0, hi = 0;
+  for(int k = 0; k < 16; k++) {
+    double t = (rgb[k*3] - mean[0])*axis[0] + (rgb[k*3 +1] - mean[1])*axis[1] + (rgb[k*3 +2] - mean[2])*axis[2];
+    lo = std::min(lo, t);
+    hi = std::max(hi, t);
+  }
+
+  double n = axis[0]*axis[0] + axis[1]*axis[1] + axis[2]*axis[2];
+  double e0[3], e1[3];
+  for(int c = 0; c < 3; c++) {
+    e0[c] = n > 0 ? mean[c] + axis[c]*hi/n : mean[c];
+    e1[c] = n > 0 ? mean[c] + axis[c]*lo/n : mean[c];
+  }
+
+  int c0 = PackRGB565(e0);
+  int c1 = PackRGB565(e1);
+
+  //c0 > c1 selects the 4 colour mode
+  if(c0 < c1) std::swap(c0, c1);
+
+  uint32_t bits = 0;
+
+  if(c0 != c1) {
+
+    int p[4][3];
+    UnpackRGB565(c0, p[0]);
+    UnpackRGB565(c1, p[1]);
+    for(int c = 0; c < 3; c++) {
+      p[2][c] = (2*p[0][c] + p[1][c])/3;
+      p[3][c] = (p[0][c] + 2*p[1][c])/3;
+    }
+
+    for(int k = 0; k < 16; k++) {
+      int best = 0, bestDist = INT32_MAX;
+      for(int i = 0; i < 4; i++) {
+        int dr = rgb[k*3] - p[i][0], dg = rgb[k*3 +1] - p[i][1], db = rgb[k*3 +2] - p[i][2];
+        int d = dr*dr + dg*dg + db*db;
+        if(d < bestDist) { bestDist = d; best = i; }
+      }
+      bits |= (uint32_t)best << (2*k);
+    }
+  }
+
+  out[0] = (unsigned char)c0; out[1] = (unsigned char)(c0 >> 8);
+  out[2] = (unsigned char)c1; out[3] = (unsigned char)(c1 >> 8);
+  for(int k = 0; k < 4; k++) {
+    out[4 + k] = (unsigned char)(bits >> (8*k));
+  }
+}
+
+//Compresses one mip level, I is 8 bit. channels picks the source channel of each component:
+//BC1 takes 3 (R,G,B), BC4 1, BC5 2. Edge blocks repeat the last row and column
+inline void CompressBlocks(const cv::Mat& I, int vkFormat, const int* channels, std::vector<unsigned char>& out) {
+
+  const int bw = (I.cols + 3)/4;
+  const int bh = (I.rows + 3)/4;
+  const int blockBytes = vkFormat == VK_FORMAT_BC5_UNORM_BLOCK ? 16 : 8;
+  const int cn = I.channels();
+
+  out.resize((size_t)bw*bh*blockBytes);
+
+  cv::parallel_for_(cv::Range(0, bh), [&](const cv::Range& range) {
+
+    for(int by = range.start; by < range.end; by++) {
+
+      const unsigned char* rows[4];
+      for(int y = 0; y < 4; y++) {
+        rows[y] = I.ptr<unsigned char>(std::min(by*4 + y, I.rows - 1));
+      }
+
+      for(int bx = 0; bx < bw; bx++) {
+
+        unsigned char px[3][16];
+        for(int y = 0; y < 4; y++) {
+          for(int x = 0; x < 4; x++) {
+            const unsigned char* p = rows[y] + std::min(bx*4 + x, I.cols - 1)*cn;
+            for(int c = 0; c < 3; c++) {
+              px[c][y*4 + x] = p[channels[std::min(c, 2)]];
+            }
+          }
+        }
+
+        unsigned char* block = &out[((size_t)by*bw + bx)*blockBytes];
+
+        if(vkFormat == VK_FORMAT_BC1_RGB_SRGB_BLOCK) {
+          unsigned char rgb[48];
+          for(int k = 0; k < 16; k++) {
+            rgb[k*3] = px[0][k]; rgb[k*3 +1] = px[1][k]; rgb[k*3 +2] = px[2][k];
+          }
+          EncodeBC1Block(rgb, block);
+        } else {
+          EncodeBC4Block(px[0], block);
+          if(vkFormat == VK_FORMAT_BC5_UNORM_BLOCK) {
+            EncodeBC4Block(px[1], block + 8);
+          }
+        }
+      }
+    }
+
+  });
+}
+
+inline void WriteU32(std::vector<unsigned char>& b, uint32_t v) {
+  for(int k = 0; k < 4; k++) b.push_back((unsigned char)(v >> (8*k)));
+}
+
+inline void WriteU64(std::vector<unsigned char>& b, uint64_t v) {
+  for(int k = 0; k < 8; k++) b.push_back((unsigned char)(v >> (8*k)));
+}
+
+//Basic data format descriptor for a 4x4 block format with one 64 bit sample per channel
+inline void DataFormatDescriptor(int vkFormat, std::vector<unsigned char>& dfd) {
+
+  int model = KHR_DF_MODEL_BC4, samples = 1, bytes = 8, transfer = 1;
+  if(vkFormat == VK_FORMAT_BC1_RGB_SRGB_BLOCK) { model = KHR_DF_MODEL_BC1A; transfer = 2; }
+  if(vkFormat == VK_FORMAT_BC5_UNORM_BLOCK) { model = KHR_DF_MODEL_BC5; samples = 2; bytes = 16; }
+
+  const int blockSize = 24 + 16*samples;
+
+  WriteU32(dfd, 4 + blockSize);
+  WriteU32(dfd, 0);                                  //vendor Khronos, basic descriptor
+  WriteU32(dfd, 2 | (blockSize << 16));              //version 1.3
+  WriteU32(dfd, model | (1 << 8) | (transfer << 16)); //BT.709 primaries, linear or sRGB
+  WriteU32(dfd, 3 | (3 << 8));                       //4x4 texels
+  WriteU32(dfd, bytes);
+  WriteU32(dfd, 0);
+
+  for(int s = 0; s < samples; s++) {
+    WriteU32(dfd, (64*s) | (63 << 16) | (s << 24));  //bit offset, length - 1, channel
+    WriteU32(dfd, 0);
+    WriteU32(dfd, 0);
+    WriteU32(dfd, 0xFFFFFFFF);
+  }
+}
+
+//Writes the compressed levels (largest first) as KTX2, level data smallest first as the spec asks
+inline bool WriteKTX2(const std::string& file, int vkFormat, int width, int height, const std::vector<std::vector<unsigned char> >& levels) {
+
+  static const unsigned char identifier[12] = { 0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A };
+
+  const int count = (int)levels.size();
+  const size_t align = vkFormat == VK_FORMAT_BC5_UNORM_BLOCK ? 16 : 8;
+
+  std::vector<unsigned char> dfd;
+  DataFormatDescriptor(vkFormat, dfd);
+
+  const size_t dfdOffset = 80 + 24*(size_t)count;
+
+  std::vector<uint64_t> offsets(count);
+  size_t end = dfdOffset + dfd.size();
+  for(int l = count - 1; l >= 0; l--) {
+    end = (end + align - 1)/align*align;
+    offsets[l] = end;
+    end += levels[l].size();
+  }
+
+  std::vector<unsigned char> header(identifier, identifier + 12);
+  WriteU32(header, vkFormat);
+  WriteU32(header, 1);
+  WriteU32(header, width);
+  WriteU32(header, height);
+  WriteU32(header, 0);
+  WriteU32(header, 0);
+  WriteU32(header, 1);
+  WriteU32(header, count);
+  WriteU32(header, 0);
+
+  WriteU32(header, (uint32_t)dfdOffset);
+  WriteU32(header, (uint32_t)dfd.size());
+  WriteU32(header, 0);
+  WriteU32(header, 0);
+  WriteU64(header, 0);
+  WriteU64(header, 0);
+
+  for(int l = 0; l < count; l++) {
+    WriteU64(header, offsets[l]);
+    WriteU64(header, levels[l].size());
+    WriteU64(header, levels[l].size());
+  }
+
+  header.insert(header.end(), dfd.begin(), dfd.end());
+
+  FILE* f = fopen(file.c_str(), "wb");
+  if (!f) {
+    return false;
+  }
+
+  bool ok = fwrite(header.data(), 1, header.size(), f) == header.size();
+  size_t at = header.size();
+
+  for(int l = count - 1; l >= 0 && ok; l--) {
+    static const unsigned char zero[16] = { 0 };
+    ok = fwrite(zero, 1, offsets[l] - at, f) == offsets[l] - at;
+    ok = ok && fwrite(levels[l].data(), 1, levels[l].size(), f) == levels[l].size();
+    at = offsets[l] + levels[l].size();
+  }
+
+  return (fclose(f) == 0) && ok;
+}
+
+//Full mip chain of I (down to 1x1) compressed and written as KTX2
+//normals = 8 bit BGR normal map (BC5, mips renormalised), otherwise BGR albedo (BC1) or gray (BC4)
+inline bool WriteCompressedTexture(const cv::Mat& I, const std::string& file, bool normals) {
+
+  int vkFormat;
+  int channels[3];
+
+  if(normals) {
+    //x is stored in the red channel of the BGR render, y in green
+    vkFormat = VK_FORMAT_BC5_UNORM_BLOCK;
+    channels[0] = 2; channels[1] = 1; channels[2] = 0;
+  } else if(I.channels() == 1) {
+    vkFormat = VK_FORMAT_BC4_UNORM_BLOCK;
+    channels[0] = 0; channels[1] = 0; channels[2] = 0;
+  } else {
+    vkFormat = VK_FORMAT_BC1_RGB_SRGB_BLOCK;
+    channels[0] = 2; channels[1] = 1; channels[2] = 0;
+  }
+
+  std::vector<std::vector<unsigned char> > levels;
+  cv::Mat level = I, next;
+
+  while(1) {
+
+    levels.push_back(std::vector<unsigned char>());
+    CompressBlocks(level, vkFormat, channels, levels.back());
+
+    if(level.cols == 1 && level.rows == 1) {
+      break;
+    }
+
+    //mip sizes round down, the reduction rounds up, the extra row/column is dropped
+    cv::Size size(std::max(1, level.cols/2), std::max(1, level.rows/2));
+    if(normals) {
+      ReduceNormals(level, next);
+      next = next(cv::Rect(0, 0, size.width, size.height));
+    } else {
+      cv::resize(level, next, size, 0, 0, cv::INTER_AREA);
+    }
+    level = next;
+    next = cv::Mat();
+  }
+
+  return WriteKTX2(file, vkFormat, I.cols, I.rows, levels);
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef TILES_HPP
+#define TILES_HPP
+
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <sys/stat.h>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+
+/*
+  Deep zoom tile pyramid
+
+  Writes name.dzi and name_files/[level]/[column]_[row].jpg in the Deep Zoom
+  layout OpenSeadragon and most tiled viewers read: level 0 is 1x1, every
+  level doubles up to the full image, each tile repeats overlap pixels of
+  its neighbours on every inner edge (0 by default, at most tile - 1). Each
+  level is reduced from the one above it. Normal maps are averaged as
+  vectors and renormalised so the smaller levels keep unit normals and do
+  not shrink towards the flat colour. All tiles of all levels are encoded
+  in parallel.
+*/
+
+#define DZI_TILE 256
+#define DZI_OVERLAP 0
+
+
+//Half size (rounded up) 8 bit BGR normal map, 2x2 normals averaged and renormalised
+inline cv::Mat& ReduceNormals(const cv::Mat& I, cv::Mat& R) {
+
+  R.create((I.rows + 1)/2, (I.cols + 1)/2, CV_8UC3);
+
+  cv::parallel_for_(cv::Range(0, R.rows), [&](const cv::Range& range) {
+
+    for(int i = range.start; i < range.end; ++i) {
+
+      const unsigned char* p0 = I.ptr<unsigned char>(2*i);
+      const unsigned char* p1 = I.ptr<unsigned char>(std::min(2*i + 1, I.rows - 1));
+      unsigned char* r = R.ptr<unsigned char>(i);
+
+      for(int j = 0; j < R.cols; ++j) {
+
+        int j0 = 2*j;
+        int j1 = std::min(2*j + 1, I.cols - 1);
+
+        //channels decode to [-1,1] the same way they were encoded, (v+1)*127.5
+        double n[3];
+        for(int c = 0; c < 3; c++) {
+          n[c] = (p0[j0*3 + c] + p0[j1*3 + c] + p1[j0*3 + c] + p1[j1*3 + c])/(4*127.5) - 1;
+        }
+
+        double mag = std::sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+
+        for(int c = 0; c < 3; c++) {
+          r[j*3 + c] = mag > 0 ? cv::saturate_cast<unsigned char>(((n[c]/mag)+1)*127.5) : p0[j0*3 + c];
+        }
+      }
+    }
+
+  });
+
+  return R;
+}
+
+//normals picks ReduceNormals for the levels, anything else is area averaged
+inline bool WriteDeepZoom(const cv::Mat& I, const std::string& name, int tile, bool normals, int overlap = DZI_OVERLAP) {
+
+  if(tile < 1) {
+    return false;
+  }
+  overlap = std::max(0, std::min(overlap, tile - 1));
+
+  int maxLevel = (int)std::ceil(std::log2((double)std::max(I.cols, I.rows)));
+
+  std::vector<cv::Mat> levels(maxLevel + 1);
+  levels[maxLevel] = I;
+
+  for(int l = maxLevel - 1; l >= 0; l--) {
+    const cv::Mat& up = levels[l + 1];
+    if(normals) {
+      ReduceNormals(up, levels[l]);
+    } else {
+      cv::resize(up, levels[l], cv::Size((up.cols + 1)/2, (up.rows + 1)/2), 0, 0, cv::INTER_AREA);
+    }
+  }
+
+  std::string files = name + "_files";
+  mkdir(files.c_str(), 0755);
+
+  //one flat list of tiles over every level so the small levels do not serialise the work
+  std::vector<cv::Vec3i> jobs;
+  for(int l = 0; l <= maxLevel; l++) {
+    mkdir((files + "/" + std::to_string(l)).c_str(), 0755);
+    for(int y = 0; y < levels[l].rows; y += tile) {
+      for(int x = 0; x < levels[l].cols; x += tile) {
+        jobs.push_back(cv::Vec3i(l, x, y));
+      }
+    }
+  }
+
+  std::vector<int> written(jobs.size(), 0);
+
+  cv::parallel_for_(cv::Range(0, (int)jobs.size()), [&](const cv::Range& range) {
+    for(int k = range.start; k < range.end; k++) {
+      int l = jobs[k][0], x = jobs[k][1], y = jobs[k][2];
+      int x0 = std::max(0, x - overlap), y0 = std::max(0, y - overlap);
+      int x1 = std::min(levels[l].cols, x + tile + overlap), y1 = std::min(levels[l].rows, y + tile + overlap);
+      cv::Rect r(x0, y0, x1 - x0, y1 - y0);
+      std::string file = files + "/" + std::to_string(l) + "/" + std::to_string(x/tile) + "_" + std::to_string(y/tile) + ".jpg";
+      written[k] = cv::imwrite(file, levels[l](r), std::vector<int>{ cv::IMWRITE_JPEG_QUALITY, 90 });
+    }
+  });
+
+  for(size_t k = 0; k < written.size(); k++) {
+    if(!written[k]) {
+      return false;
+    }
+  }
+
+  std::ofstream dzi(name + ".dzi");
+  dzi << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"jpg\" Overlap=\"" << overlap << "\" TileSize=\"" << tile << "\">\n"
+      << "  <Size Width=\"" << I.cols << "\" Height=\"" << I.rows << "\"/>\n"
+      << "</Image>\n";
+
+  return dzi.good();
+}
+
+#endif
@@ -0,0 +1,243 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <thread>
+#include <algorithm>
+#include <functional>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "albedo.hpp"
+#include "highlight.hpp"
+#include "normal.hpp"
+#include "pool.hpp"
+#include "tune.hpp"
+
+
+using namespace cv;
+using namespace std;
+
+
+/*
+  Autotuner
+
+  Times the row loops on a sample of a real light set and writes the
+  fastest settings to this host's profile (see tune.hpp). The search
+  kernels run on the 1/8 images the search uses, AverageImages and
+  GetHighlight on a band of full resolution rows. First the thread count
+  is picked with the default stripes, then the stripes of each loop, then
+  the planar or packed layout for the search.
+*/
+
+struct TuneData {
+  Mat search[3];
+  Mat packed;
+  Mat color[3];
+  double Sinv[BATCH_SIZE][3][3];
+  int th;
+};
+
+double TimeBest(function<void()> body, int runs);
+double TimeSearch(TuneData& d, bool packed);
+double TimeBatch(TuneData& d, bool packed);
+double TimeAverage(TuneData& d);
+double TimeHighlight(TuneData& d);
+int PickStripes(int& stripes, function<double()> timed, string name);
+
+
+int main( int argc, char* argv[]) {
+
+  UseBufferPool();
+
+  if (argc < 3) {
+
+    cout << "Not enough parameters" << endl;
+    cout << "How to use: \n" << "'/Path/To/Folder' 'threshold(int)' [--rows n] [--out file]";
+    return -1;
+
+  }
+
+  int rows = 512;
+  string out = TuneProfilePath();
+
+  for(int k = 3; k < argc; k++) {
+    string arg = argv[k];
+    if(arg == "--rows" && k+1 < argc) {
+      rows = stoi(argv[++k]);
+    } else if(arg == "--out" && k+1 < argc) {
+      out = argv[++k];
+    } else {
+      cout << "Unknown option " << arg << endl;
+      return -1;
+    }
+  }
+
+  TuneData d;
+  d.th = stoi(argv[2]);
+
+  for(int k = 0; k < 3; k++) {
+
+    string file = argv[1]+string("/final_")+to_string(k+1)+".jpg";
+    Mat color = imread(file, IMREAD_COLOR);
+    d.search[k] = imread(file, IMREAD_REDUCED_GRAYSCALE_8);
+
+    if (!color.data || !d.search[k].data) {
+      cout << "The image " << file << " could not be loaded." << endl;
+      return -1;
+    }
+
+    //a band from the middle, the edges of a scan are often background
+    int n = min(rows, color.rows);
+    Range band((color.rows - n)/2, (color.rows - n)/2 + n);
+    d.color[k] = color.rowRange(band.start, band.end).clone();
+  }
+
+  //the folder's own calibration when there is one, any invertible matrix times the same
+  Mat S(3, 3, CV_8SC1, Scalar(0));
+  if (!LoadCalibration(S, argv[1]+string("/calibration.txt"))) {
+    int example[3][3] = { { 62, 120, 9 }, { 250, 40, 180 }, { 30, 90, 150 } };
+    for(int i = 0; i < 3; i++) {
+      for(int j = 0; j < 3; j++) {
+        S.at<unsigned char>(i,j) = (unsigned char)example[i][j];
+      }
+    }
+  }
+  for(int c = 0; c < BATCH_SIZE; c++) {
+    Mat N = S.clone();
+    N.at<unsigned char>(c/3, c%3) += 1;
+    InvertCalibration(N, d.Sinv[c]);
+  }
+
+  PackLights(d.search, 3, d.packed);
+
+  cout << "Sample: search " << d.search[0].cols << "x" << d.search[0].rows << ", full " << d.color[0].cols << "x" << d.color[0].rows << endl;
+
+  //defaults while the thread count is picked
+  TuneProfile& p = Tuning();
+  p = TuneProfile();
+
+  int cores = max(1, (int)thread::hardware_concurrency());
+  vector<int> counts;
+  for(int t = 1; t < cores; t *= 2) {
+    counts.push_back(t);
+  }
+  counts.push_back(cores);
+
+  double bestTime = 0;
+  for(size_t k = 0; k < counts.size(); k++) {
+
+    setNumThreads(counts[k]);
+    double t = TimeSearch(d, false) + TimeBatch(d, false) + TimeAverage(d) + TimeHighlight(d);
+    cout << "threads " << counts[k] << ": " << t << " ms" << endl;
+
+    if (k == 0 || t < bestTime) {
+      bestTime = t;
+      p.threads = counts[k];
+    }
+  }
+  setNumThreads(p.threads);
+
+  PickStripes(p.normalStripes, [&]() { return TimeSearch(d, false); }, "normal");
+  PickStripes(p.batchStripes, [&]() { return TimeBatch(d, false); }, "batch");
+  PickStripes(p.averageStripes, [&]() { return TimeAverage(d); }, "average");
+  PickStripes(p.highlightStripes, [&]() { return TimeHighlight(d); }, "highlight");
+
+  double planar = TimeSearch(d, false) + TimeBatch(d, false);
+  double packed = TimeSearch(d, true) + TimeBatch(d, true);
+  p.packed = packed < planar;
+  cout << "search layout: planar " << planar << " ms, packed " << packed << " ms" << endl;
+
+  if (!SaveTuneProfile(out, p)) {
+    cout << "Could not write " << out << endl;
+    return -1;
+  }
+
+  cout << "Wrote " << out << ": threads " << p.threads << ", stripes normal " << p.normalStripes << " batch " << p.batchStripes
+       << " average " << p.averageStripes << " highlight " << p.highlightStripes << ", " << (p.packed ? "packed" : "planar") << endl;
+
+  return 0;
+}
+
+
+//Fastest of runs, in milliseconds, after one warm up run
+double TimeBest(function<void()> body, int runs) {
+
+  body();
+
+  double best = 0;
+  for(int r = 0; r < runs; r++) {
+    double t = (double)getTickCount();
+    body();
+    t = 1000*((double)getTickCount() - t)/getTickFrequency();
+    if (r == 0 || t < best) best = t;
+  }
+  return best;
+}
+
+//a block of search iterations, the loop that runs thousands of times per folder
+double TimeSearch(TuneData& d, bool packed) {
+
+  NormalKernel kernel = SelectNormalKernel(3, CV_8U, NORMAL_BGR8, true, packed);
+  Mat O;
+
+  return TimeBest([&]() {
+    for(int i = 0; i < 20; i++) {
+      if (packed) {
+        RunPackedNormalKernel(kernel, NORMAL_BGR8, d.packed, d.search[0].cols, O, d.Sinv[i % BATCH_SIZE][0], d.th);
+      } else {
+        RunNormalKernel(kernel, NORMAL_BGR8, d.search, O, d.Sinv[i % BATCH_SIZE][0], d.th);
+      }
+    }
+  }, 5);
+}
+
+double TimeBatch(TuneData& d, bool packed) {
+
+  long costs[BATCH_SIZE];
+
+  return TimeBest([&]() {
+    for(int i = 0; i < 5; i++) {
+      if (packed) {
+        CalculatePackedBatchCost(d.packed, d.search[0].cols, d.Sinv[0][0], BATCH_SIZE, d.th, costs);
+      } else {
+        CalculateBatchCost(d.search, d.Sinv[0][0], BATCH_SIZE, d.th, costs);
+      }
+    }
+  }, 5);
+}
+
+double TimeAverage(TuneData& d) {
+
+  Mat I(d.color[0].rows, d.color[0].cols, d.color[0].type());
+  return TimeBest([&]() { AverageImages(d.color[0], d.color[1], d.color[2], I); }, 5);
+}
+
+double TimeHighlight(TuneData& d) {
+
+  Mat O;
+  return TimeBest([&]() { GetHighlight(d.color[0], d.th, O); }, 5);
+}
+
+//leaves stripes at the fastest candidate
+int PickStripes(int& stripes, function<double()> timed, string name) {
+
+  static const int candidates[] = { 1, 2, 4, 8, 16, 32 };
+
+  double best = 0;
+  int pick = stripes;
+
+  for(int k = 0; k < 6; k++) {
+    stripes = candidates[k];
+    double t = timed();
+    cout << name << " stripes " << stripes << ": " << t << " ms" << endl;
+    if (k == 0 || t < best) {
+      best = t;
+      pick = stripes;
+    }
+  }
+
+  stripes = pick;
+  return pick;
+}
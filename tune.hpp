@@ -0,0 +1,133 @@
+#ifndef TUNE_HPP
+#define TUNE_HPP
+
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <algorithm>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <opencv2/core/core.hpp>
+
+
+/*
+  Tuning profile
+
+  Per host settings for the row loops, measured by ./tune on real data and
+  loaded by every tool at startup. Each loop splits its rows into
+  (threads x stripes) tasks, more stripes balance uneven rows better, fewer
+  keep each task's rows in cache longer. One key per line:
+
+    threads 16            cv::setNumThreads, 0 leaves OpenCV's default
+    normal_stripes 4      normal kernels (search and render)
+    batch_stripes 4       batch cost of the search
+    average_stripes 2     AverageImages
+    highlight_stripes 4   GetHighlight
+    packed 1              search on the packed layout unless told otherwise
+
+  The file is PS_TUNE_PROFILE if set, otherwise ~/.photostereo/tune_[host].txt,
+  so nodes sharing a home directory keep their own. PS_TUNE=0 ignores it.
+*/
+
+#define TUNE_STRIPES 4
+
+struct TuneProfile {
+  int threads;
+  int normalStripes;
+  int batchStripes;
+  int averageStripes;
+  int highlightStripes;
+  bool packed;
+  bool loaded;
+
+  TuneProfile() : threads(0), normalStripes(TUNE_STRIPES), batchStripes(TUNE_STRIPES),
+    averageStripes(TUNE_STRIPES), highlightStripes(TUNE_STRIPES), packed(false), loaded(false) {}
+};
+
+//The settings in use, defaults until UseTuneProfile loads a file
+inline TuneProfile& Tuning() {
+  static TuneProfile profile;
+  return profile;
+}
+
+//Tasks for a loop over rows, stripes per thread of the current thread count
+inline int TuneStripes(int rows, int stripes) {
+  return std::max(1, std::min(rows, cv::getNumThreads()*stripes));
+}
+
+inline std::string TuneProfilePath() {
+
+  const char* file = getenv("PS_TUNE_PROFILE");
+  if (file && *file) {
+    return file;
+  }
+
+  char host[256] = { 0 };
+  gethostname(host, sizeof(host) - 1);
+
+  const char* home = getenv("HOME");
+  return std::string(home ? home : ".") + "/.photostereo/tune_" + host + ".txt";
+}
+
+inline bool LoadTuneProfile(const std::string& file, TuneProfile& p) {
+
+  std::ifstream in(file);
+  if (!in.is_open()) {
+    return false;
+  }
+
+  std::string key;
+  int value;
+  while (in >> key >> value) {
+    if (key == "threads") p.threads = std::max(0, value);
+    else if (key == "normal_stripes") p.normalStripes = std::max(1, value);
+    else if (key == "batch_stripes") p.batchStripes = std::max(1, value);
+    else if (key == "average_stripes") p.averageStripes = std::max(1, value);
+    else if (key == "highlight_stripes") p.highlightStripes = std::max(1, value);
+    else if (key == "packed") p.packed = value != 0;
+  }
+
+  p.loaded = true;
+  return true;
+}
+
+inline bool SaveTuneProfile(const std::string& file, const TuneProfile& p) {
+
+  //one level is enough for the default location
+  size_t slash = file.find_last_of('/');
+  if (slash != std::string::npos && slash > 0) {
+    mkdir(file.substr(0, slash).c_str(), 0755);
+  }
+
+  std::ofstream out(file);
+  out << "threads " << p.threads << "\n"
+      << "normal_stripes " << p.normalStripes << "\n"
+      << "batch_stripes " << p.batchStripes << "\n"
+      << "average_stripes " << p.averageStripes << "\n"
+      << "highlight_stripes " << p.highlightStripes << "\n"
+      << "packed " << (p.packed ? 1 : 0) << "\n";
+
+  return out.good();
+}
+
+//Loads this host's profile once and applies the thread count, call first thing in main
+//A library loaded into someone else's process passes threads = false and leaves cv::setNumThreads to its host
+inline TuneProfile& UseTuneProfile(bool threads = true) {
+
+  static bool done = false;
+  TuneProfile& p = Tuning();
+
+  if (!done) {
+    done = true;
+    const char* use = getenv("PS_TUNE");
+    if (!(use && atoi(use) == 0) && LoadTuneProfile(TuneProfilePath(), p) && threads && p.threads > 0) {
+      cv::setNumThreads(p.threads);
+    }
+  }
+
+  return p;
+}
+
+#endif